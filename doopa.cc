@@ -20,24 +20,54 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <time.h>
 #include <inttypes.h>
 #include <unordered_map>
 #include <map>
+#include <deque>
+#include <queue>
+#include <string>
+#include <vector>
+#include <algorithm>
 #include <tuple>
 #include <utility>
 #include <functional>
 #include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
 
 #include <openssl/sha.h>
+#include <zlib.h>
 
 #include "htslib/thread_pool.h"
 #include "htslib/hfile.h"
 #include "htslib/sam.h"
+#include "htslib/cram.h"
 
 // Pack into 64 bits:
 // chr  start   len
@@ -58,10 +88,91 @@
 
 #define ABS(x)  ((x < 0) ? (-x) : (x))
 
-#define MAX_THREADS	8
+// Threads used when -@ is not given
+#define DEFAULT_THREADS 8
 #define FRAGMENT_BIN_SIZE 5
 #define MAX_FRAGMENT_SIZE 2000
 
+// Pages of the in-memory read arena
+#define ARENA_PAGE_SIZE (64 << 20)
+// Reads sampled to estimate the decoded size of the input
+#define ARENA_SAMPLE_READS 10000
+
+// Reads waiting for their mate when there is no MC tag
+#define MATE_CACHE_SIZE 1000000
+
+// Default distance in bases a duplicate may start before the
+// current read when streaming
+#define STREAM_WINDOW 1000
+
+// Reads are identified by the input they come from and their virtual offset in it,
+// which leaves 40 bits, or 1 TiB, for the compressed offset
+#define INPUT_SHIFT 56
+#define MAX_INPUTS (1 << (64 - INPUT_SHIFT))
+#define MAX_INPUT_SIZE (1ULL << (INPUT_SHIFT - 16))
+#define READ_ID(input, voffset) (((uint64_t)(input) << INPUT_SHIFT) | (voffset))
+#define READ_INPUT(id) ((int)((id) >> INPUT_SHIFT))
+#define READ_VOFFSET(id) ((id) & ((1ULL << INPUT_SHIFT) - 1))
+
+// Seek rather than read through when the next surviving read is
+// at least this many compressed bytes further on
+#define SEEK_GAP (1 << 20)
+
+// Reads between two saves of the pass 1 state with --checkpoint
+#define CHECKPOINT_READS 100000000
+
+// Regions less than this many bases apart are deduplicated together, so
+// reads clipped across the gap still meet their duplicates
+#define REGION_GAP 1000
+
+// Compressing bam or cram output costs about this many times as much as
+// inflating the input, its queue on the shared thread pool is that much longer
+#define ENCODE_WEIGHT 3
+
+// Big tables are allocated in multiples of a huge page
+#define HUGE_PAGE_SIZE (2 << 20)
+
+// Slabs the nodes of the streaming groups table are cut from, and the largest node
+#define POOL_SLAB_SIZE (16 << 20)
+#define POOL_MAX_NODE 128
+
+// Slots of the old array moved over on every insert while the winner table
+// grows, enough to empty it before the new one is full in turn
+#define TABLE_MIGRATE 8
+
+// Spans each thread keeps for --trace, and reads of the main loop in one span
+#define TRACE_RING 65536
+#define TRACE_BATCH 65536
+
+// One read in this many is timed with --profile
+#define PROFILE_SAMPLE 64
+
+// Memory for sorting survivors before they are written out as temporary runs
+#define SORT_MEMORY (768ULL << 20)
+// Below this many reads a buffer is sorted on a single thread
+#define SORT_MIN_PARALLEL 100000
+
+// Tabs looked for in a line of sam text, enough for all fields and some tags
+#define SAM_MAX_TABS 64
+// Initial size of the sam text read buffer, it grows for longer lines
+#define SAM_BUF_SIZE (4 << 20)
+
+// Bgzf blocks of a bam input being inflated at once
+#define INFLATE_QUEUE 64
+// How far ahead of those the kernel is asked to read a mapped input
+#define MAP_READAHEAD (64 << 20)
+// Size of the reads prefetching an input, each one reads a block further
+// so that every block starting in it is whole
+#define PREFETCH_CHUNK (8 << 20)
+// Most threads doing prefetch reads without io_uring. They wait on the
+// disk, so they are not taken from the pool inflating the blocks
+#define PREFETCH_THREADS 4
+
+// What the first pass needs decoded from a cram record, the sequence is
+// not reconstructed
+#define PASS1_FIELDS (SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | \
+                      SAM_RNEXT | SAM_PNEXT | SAM_TLEN | SAM_QUAL | SAM_AUX)
+
 typedef struct {
   uint64_t lo;
   uint64_t hi;
@@ -238,284 +349,5770 @@ static void make_key(chrposlen_t *key, bam1_t *bam) {
     key->hi = PACK_CHRPOSLEN(chr2, start2, len2);
 }
 
+/* Unclipped position, length and strand of a read, packed as one end of a key. */
+static uint64_t pack_end(bam1_t *b)
+{
+    uint32_t start = unclipped_start(b);
+    uint32_t len = ABS(unclipped_end(b) - start);
+
+    if (b->core.flag & BAM_FREVERSE)
+        len |= (1 << 23);
+    return PACK_CHRPOSLEN(b->core.tid, start, len);
+}
+
 bool key_equal_to(const chrposlen_t& k1, const chrposlen_t& k2) {
-    return key_hash(k1) == key_hash(k2);
+    return k1.lo == k2.lo && k1.hi == k2.hi;
 }
 
-typedef std::unordered_map<chrposlen_t, std::pair<uint64_t, uint64_t>,
-        std::function<size_t(const chrposlen_t&)>,
-        std::function<bool(const chrposlen_t&, const chrposlen_t&)> > doopa_t;
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
 
-typedef std::map<uint64_t, uint64_t> fragment_t;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-static inline uint64_t get_qualsum(const bam1_t *b, uint64_t *total, uint64_t *q30)
+/* CPU time used by the whole process, or by the calling thread. */
+static inline uint64_t cpu_ns(clockid_t clock)
 {
-    int i;
-    uint64_t sum, q, len;
-    uint8_t *qual = bam_get_qual(b);
+    struct timespec ts;
 
-    len = b->core.l_qseq;
-    for (i = sum = 0; i < len; ++i) {
-        q = qual[i];
-        sum += q;
-        if (q30 && q >= 30) {
-            (*q30)++;
-        }
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* --trace: spans of work on every thread, written out at exit as Chrome
+   trace events, which chrome://tracing and Perfetto load. Each thread
+   keeps its spans in a ring of its own, so recording one takes no lock,
+   and only the last TRACE_RING spans of a thread are kept. */
+typedef struct {
+    const char *name;
+    uint64_t start, dur;
+} trace_span_t;
+
+typedef struct trace_ring_s {
+    int tid;
+    uint64_t n;         // spans recorded, the last TRACE_RING are kept
+    trace_span_t spans[TRACE_RING];
+    struct trace_ring_s *next;
+} trace_ring_t;
+
+static struct {
+    const char *path;
+    uint64_t t0;
+    pthread_mutex_t lock;
+    trace_ring_t *rings;
+} tracer = { NULL, 0, PTHREAD_MUTEX_INITIALIZER, NULL };
+
+static __thread trace_ring_t *trace_ring;
+
+/* When a span starts, 0 if nothing is traced. */
+static inline uint64_t trace_begin(void)
+{
+    return tracer.path ? now_ns() : 0;
+}
+
+/* Record the span name started at start, by trace_begin(). */
+static void trace_end(const char *name, uint64_t start)
+{
+    trace_ring_t *r = trace_ring;
+    trace_span_t *sp;
+
+    if (!start)
+        return;
+    if (!r) {
+        if (!(r = (trace_ring_t *)calloc(1, sizeof(*r))))
+            return;
+        r->tid = syscall(SYS_gettid);
+        pthread_mutex_lock(&tracer.lock);
+        r->next = tracer.rings;
+        tracer.rings = r;
+        pthread_mutex_unlock(&tracer.lock);
+        trace_ring = r;
     }
-    if (total)
-        *total += len;
-    return sum;
+    sp = &r->spans[r->n++ % TRACE_RING];
+    sp->name = name;
+    sp->start = start;
+    sp->dur = now_ns() - start;
 }
 
-void print_frag_stats(fragment_t *frag_hist, uint64_t total_fragments)
+/* Write the spans of all threads, at exit. */
+static void trace_write(void)
 {
-    float half_dist = total_fragments * 0.5f;
-    float csum = 0.f;
-    float dist = 0.f;
-    float mean = 0.f;
-    float stdev = 0.f;
-    float cstd = 0.f;
-    float median = 0.f;
-    int found = 0;
+    const char *sep = "";
+    FILE *fp;
 
-    for (fragment_t::iterator frag = frag_hist->begin(); frag != frag_hist->end(); frag++) {
-        float mi = (float)frag->first * (float)FRAGMENT_BIN_SIZE + (float)FRAGMENT_BIN_SIZE * 0.5f;
-        float curr = mi * (float)frag->second;
-        dist += (float)frag->second;
-        csum += curr;
-        if (!found && (dist >= half_dist)) {
-            /* L + ( (n/2 – F) / f ) * w */
-            median = ((float)frag->first * (float)FRAGMENT_BIN_SIZE) + ((half_dist - dist) / (float)frag->second) * (float)FRAGMENT_BIN_SIZE;
-            found = 1;
+    pthread_mutex_lock(&tracer.lock);
+    if (!(fp = fopen(tracer.path, "w"))) {
+        error("Couldn't write the trace to \"%s\"", tracer.path);
+        pthread_mutex_unlock(&tracer.lock);
+        return;
+    }
+    fprintf(fp, "{\"traceEvents\": [\n");
+    for (trace_ring_t *r = tracer.rings; r; r = r->next) {
+        fprintf(fp, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                "\"args\": {\"name\": \"%s\"}}", sep, (int)getpid(), r->tid,
+                r->tid == getpid() ? "main" : "worker");
+        sep = ",\n";
+        for (uint64_t i = r->n > TRACE_RING ? r->n - TRACE_RING : 0; i < r->n; i++) {
+            const trace_span_t *sp = &r->spans[i % TRACE_RING];
+            fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                    "\"pid\": %d, \"tid\": %d}", sp->name, (sp->start - tracer.t0) / 1e3,
+                    sp->dur / 1e3, (int)getpid(), r->tid);
         }
     }
-    mean = csum / (float)total_fragments;
+    fprintf(fp, "\n]}\n");
+    if (fclose(fp) != 0)
+        error("Couldn't write the trace to \"%s\"", tracer.path);
+    pthread_mutex_unlock(&tracer.lock);
+}
 
-    for (fragment_t::iterator frag = frag_hist->begin(); frag != frag_hist->end(); frag++) {
-        float mi = (float)frag->first * (float)FRAGMENT_BIN_SIZE + (float)FRAGMENT_BIN_SIZE * 0.5f;
-        float cmu = mi - mean;
-        cstd += (float)frag->second * cmu * cmu;
-    }
-    stdev = sqrt(cstd / ((float)total_fragments - 1.f));
+static void trace_open(const char *path)
+{
+    tracer.path = path;
+    tracer.t0 = now_ns();
+    atexit(trace_write);
+}
 
-    error("Mean fragment size: %.4f", mean);
-    error("Median fragment size: %.0f", median);
-    error("Stdev fragment size: %.4f", stdev);
+/* Map memory for a big table. Explicit huge pages are used when some are
+   reserved, otherwise the kernel is asked for transparent ones, so that
+   lookups all over the table do not miss the TLB on every access. */
+static void *big_alloc(size_t size)
+{
+    size_t len = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    uint8_t *p, *q;
+
+    p = (uint8_t *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+        return p;
+
+    // align it to a huge page by hand, then trim what is left over
+    p = (uint8_t *)mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    q = (uint8_t *)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (q > p)
+        munmap(p, q - p);
+    munmap(q + len, p + HUGE_PAGE_SIZE - q);
+    madvise(q, len, MADV_HUGEPAGE);
+    return q;
 }
 
-static void dedup_bam(const char *filename, bool stats_only, const char *debugread)
+static void big_free(void *p, size_t size)
 {
-    htsThreadPool p = {NULL, 0};
-    uint64_t total_reads = 0;
-    uint64_t paired_reads = 0;
-    uint64_t mapped_reads = 0;
-    uint64_t bases_above_q30 = 0;
-    uint64_t total_bases = 0;
-    uint64_t duplicate_reads = 0;
-    uint64_t qualsum, existing_qual, fragment_bin;
-    chrposlen_t key;
-    hts_itr_t *iter;
-    bam1_t *b;
-    bam_hdr_t *hdr = NULL;
-    samFile *out = NULL;
-    samFile *in = NULL;
-    hts_idx_t *idx = NULL;
-    htsFormat _bam;
-    hts_parse_format(&_bam, "bam");
+    munmap(p, (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1));
+}
 
-    htsFile *fp = hts_open(filename,"r");
-    if (!fp) {
-        if (errno == ENOEXEC) {
-            error("Couldn't understand format of \"%s\"", filename);
-            exit(1);
-        } else {
-            error("Couldn't open \"%s\"", filename);
-            exit(1);
-        }
-    }
+/* Nodes of the per-run hash tables, cut from slabs and all given back at
+   once when the run is over, instead of one malloc each. Freed nodes are
+   kept for reuse by size. The pool must outlive the tables using it. */
+struct node_pool_t {
+    std::vector<uint8_t *> slabs;
+    size_t used;                        // of the last slab
+    uint64_t live;                      // nodes handed out and not freed
+    void *free[POOL_MAX_NODE / 8 + 1];  // by size in words
 
-    enum htsExactFormat format = hts_get_format(fp)->format;
-    if (format != bam) {
-        error("File \"%s\" is not a bam file", filename);
-        exit(1);
+    node_pool_t() : used(POOL_SLAB_SIZE), live(0) { memset(free, 0, sizeof(free)); }
+    ~node_pool_t() { release(); }
+
+    void *get(size_t size)
+    {
+        size_t i = (size + 7) / 8;
+        void *p;
+
+        live++;
+        if ((p = free[i])) {
+            free[i] = *(void **)p;
+            return p;
+        }
+        if (used + i * 8 > POOL_SLAB_SIZE) {
+            if (!(p = big_alloc(POOL_SLAB_SIZE)))
+                throw std::bad_alloc();
+            slabs.push_back((uint8_t *)p);
+            used = 0;
+        }
+        p = slabs.back() + used;
+        used += i * 8;
+        return p;
     }
 
-    hts_close(fp);
+    void put(void *p, size_t size)
+    {
+        size_t i = (size + 7) / 8;
 
-    in = sam_open(filename, "r");
+        live--;
+        *(void **)p = free[i];
+        free[i] = p;
+    }
 
-    if ((idx = sam_index_load(in, filename)) == 0) {
-        error("cannot open bam index");
-        exit(1);
+    /* Give the slabs back once the tables are cleared. */
+    void release()
+    {
+        if (live)
+            return;
+        for (size_t i = 0; i < slabs.size(); i++)
+            big_free(slabs[i], POOL_SLAB_SIZE);
+        slabs.clear();
+        used = POOL_SLAB_SIZE;
+        memset(free, 0, sizeof(free));
     }
 
-    doopa_t mp((doopa_t::size_type)1000000, key_hash, key_equal_to);
-    fragment_t fragment_histogram;
+private:
+    node_pool_t(const node_pool_t&);
+    node_pool_t& operator=(const node_pool_t&);
+};
 
-    out = sam_open("/dev/stdout", "w");
+/* Allocator of the per-run hash tables. Nodes come from the pool, arrays
+   such as the bucket array, rebuilt every time a table grows, are big
+   enough to go to big_alloc(). */
+template <class T> struct pool_alloc {
+    typedef T value_type;
+    node_pool_t *pool;
 
-    if (out == NULL) { error("reopening standard output failed"); goto clean; }
+    explicit pool_alloc(node_pool_t *pool) : pool(pool) {}
+    template <class U> pool_alloc(const pool_alloc<U>& a) : pool(a.pool) {}
 
-    if (!(p.pool = hts_tpool_init(MAX_THREADS))) {
-        error("error creating thread pool");
-        goto clean;
-    }
-    hts_set_opt(in,  HTS_OPT_THREAD_POOL, &p);
-    hts_set_opt(out, HTS_OPT_THREAD_POOL, &p);
+    T *allocate(size_t n)
+    {
+        size_t size = n * sizeof(T);
+        void *p;
 
-    hdr = sam_hdr_read(in);
-    if (hdr == NULL) {
-        errno = 0; error("reading headers from \"%s\" failed", filename);
-        goto clean;
+        if (size <= POOL_MAX_NODE)
+            return (T *)pool->get(size);
+        p = size >= HUGE_PAGE_SIZE ? big_alloc(size) : malloc(size);
+        if (!p)
+            throw std::bad_alloc();
+        return (T *)p;
     }
 
-    if (!stats_only) {
-        if (sam_hdr_write(out, hdr) != 0) {
-            error("writing headers to standard output failed");
-            goto clean;
-        }
+    void deallocate(T *p, size_t n)
+    {
+        size_t size = n * sizeof(T);
+
+        if (size <= POOL_MAX_NODE)
+            pool->put(p, size);
+        else if (size >= HUGE_PAGE_SIZE)
+            big_free(p, size);
+        else
+            free(p);
     }
+};
 
-    error("Start deduping...");
+template <class T, class U>
+bool operator==(const pool_alloc<T>& a, const pool_alloc<U>& b) { return a.pool == b.pool; }
+template <class T, class U>
+bool operator!=(const pool_alloc<T>& a, const pool_alloc<U>& b) { return a.pool != b.pool; }
 
-    iter = sam_itr_queryi(idx, HTS_IDX_START, 0, 0);
-    b = bam_init1();
-    if (b == NULL) { error("can't create record"); exit(1); }
-    for(; sam_itr_next(in, iter, b) >= 0; total_reads++) {
-        const bam1_core_t *c = &b->core;
-        if (*debugread && !strncmp((const char *)b->data, debugread, 128)) {
-            error("found debugread %s", debugread);
-        }
-        if (c->tid < 0) {
-            continue;
-        }
-        // read must not be secondary, supplementary, unmapped or failed QC
-        if (c->flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY | BAM_FUNMAP | BAM_FQCFAIL)) {
-            continue;
-        }
-        mapped_reads++;
-        if (c->mtid >= 0) {
-            if ((c->flag & BAM_FPROPER_PAIR) &&
-                    c->isize > 0 && c->qual > 30) {
-                if (c->isize > MAX_FRAGMENT_SIZE) {
-                    fragment_bin = MAX_FRAGMENT_SIZE / FRAGMENT_BIN_SIZE;
-                } else {
-                    fragment_bin = c->isize / FRAGMENT_BIN_SIZE;
+/* An entry of the winner table, a hash of 0 marks an empty slot. The key
+   comes last so that with --compact-keys it is simply left out. */
+typedef struct {
+    uint64_t hash;
+    std::pair<uint64_t, uint64_t> second;   // read id, quality sum
+    chrposlen_t first;
+} table_entry_t;
+
+// Size of an entry that only keeps the hash of its key
+#define COMPACT_ENTRY_SIZE offsetof(table_entry_t, first)
+
+/* The winner table: open addressing with linear probing on the key hash,
+   which is kept in the entry so it is never computed twice. The slots come
+   from big_alloc(), where a fresh array is all empty. The table doubles
+   when it is 3/4 full, but rather than rehashing everything at once the
+   entries of the old array move over a few slots per insert, and lookups
+   look in both until it is empty. No insert pays for the whole table, so
+   pass 1 runs at the same pace however big the table gets.
+   A compact table keeps only the hashes of the keys, not the keys, and
+   takes keys with the same hash for the same key. */
+class doopa_t {
+public:
+    class iterator {
+    public:
+        iterator(uint8_t *p = NULL, uint8_t *end = NULL, uint8_t *p2 = NULL, uint8_t *end2 = NULL,
+                 size_t esize = 0) : p(p), end(end), p2(p2), end2(end2), esize(esize) { if (end) skip(); }
+
+        table_entry_t& operator*() const { return *(table_entry_t *)p; }
+        table_entry_t *operator->() const { return (table_entry_t *)p; }
+        bool operator==(const iterator& o) const { return p == o.p; }
+        bool operator!=(const iterator& o) const { return p != o.p; }
+        iterator& operator++() { p += esize; skip(); return *this; }
+        iterator operator++(int) { iterator it = *this; ++*this; return it; }
+
+    private:
+        uint8_t *p, *end, *p2, *end2;   // slots left to go, in two arrays
+        size_t esize;
+
+        void skip()
+        {
+            for (;;) {
+                while (p < end && !((table_entry_t *)p)->hash)
+                    p += esize;
+                if (p < end)
+                    return;
+                if (!p2) {
+                    p = NULL;
+                    return;
                 }
-                fragment_histogram[fragment_bin]++;
-                paired_reads += 2;
+                p = p2;
+                end = end2;
+                p2 = NULL;
             }
         }
-        make_key(&key, b);
-        qualsum = get_qualsum(b, &total_bases, &bases_above_q30);
-        if (mp.count(key)) {
-            // Key exists
-            duplicate_reads++;
-            existing_qual = std::get<1>(mp[key]);
-            if (qualsum > existing_qual) {
-                mp[key] = std::make_pair(total_reads, qualsum);
-            }
-        } else {
-            mp[key] = std::make_pair(total_reads, qualsum);
+    };
+    typedef iterator const_iterator;
+
+    explicit doopa_t(size_t n, bool compact = false)
+        : slots(NULL), old(NULL), mask(0), old_mask(0), moved(0), n(0),
+          esize(compact ? COMPACT_ENTRY_SIZE : sizeof(table_entry_t)),
+          lookups(0), probes(0), grows(0) { reserve(n); }
+    ~doopa_t() { clear(); }
+
+    size_t size() const { return n; }
+    bool compact() const { return esize != sizeof(table_entry_t); }
+    double load() const { return slots ? (double)n / (mask + 1) : 0; }
+    size_t bytes() const { return ((slots ? mask + 1 : 0) + (old ? old_mask + 1 : 0)) * esize; }
+
+    // for --profile
+    uint64_t n_lookups() const { return lookups; }
+    uint64_t n_probes() const { return probes; }
+    uint64_t n_grows() const { return grows; }
+    iterator end() const { return iterator(); }
+
+    /* The new array first, then what is left of the old one. */
+    iterator begin() const
+    {
+        if (!slots)
+            return end();
+        if (!old)
+            return iterator(slots, slots + (mask + 1) * esize, NULL, NULL, esize);
+        return iterator(slots, slots + (mask + 1) * esize,
+                        old + moved * esize, old + (old_mask + 1) * esize, esize);
+    }
+
+    iterator find(const chrposlen_t& key) const
+    {
+        return iterator((uint8_t *)lookup(hash(key), key));
+    }
+
+    std::pair<iterator, bool> insert(const std::pair<chrposlen_t, std::pair<uint64_t, uint64_t> >& kv)
+    {
+        uint64_t h = hash(kv.first);
+        table_entry_t *e = lookup(h, kv.first);
+
+        if (e)
+            return std::make_pair(iterator((uint8_t *)e), false);
+        if (!slots || n + 1 > (mask + 1) / 4 * 3)
+            grow();
+        migrate(TABLE_MIGRATE);
+        e = place(slots, mask, h);
+        e->second = kv.second;
+        if (!compact())
+            e->first = kv.first;
+        n++;
+        return std::make_pair(iterator((uint8_t *)e), true);
+    }
+
+    std::pair<uint64_t, uint64_t>& operator[](const chrposlen_t& key)
+    {
+        return insert(std::make_pair(key, std::make_pair((uint64_t)0, (uint64_t)0))).first->second;
+    }
+
+    /* Make room for n entries at once, when their number is known. */
+    void reserve(size_t want)
+    {
+        size_t cap = 1024;
+        uint8_t *prev = slots;
+        uint64_t prev_mask = mask, t;
+
+        while (cap / 4 * 3 < want)
+            cap *= 2;
+        if (slots && cap <= mask + 1)
+            return;
+        t = trace_begin();
+        migrate(SIZE_MAX);
+        slots = alloc(cap);
+        mask = cap - 1;
+        for (uint64_t i = 0; prev && i <= prev_mask; i++)
+            move(prev, i);
+        if (prev)
+            big_free(prev, (prev_mask + 1) * esize);
+        trace_end("table reserve", t);
+    }
+
+    /* Unmap the slots, without visiting them. */
+    void clear()
+    {
+        if (slots)
+            big_free(slots, (mask + 1) * esize);
+        if (old)
+            big_free(old, (old_mask + 1) * esize);
+        slots = old = NULL;
+        mask = old_mask = moved = n = 0;
+    }
+
+private:
+    uint8_t *slots, *old;           // old is being moved over to slots
+    uint64_t mask, old_mask;
+    uint64_t moved;                 // slots of old moved over
+    size_t n;
+    size_t esize;
+    mutable uint64_t lookups, probes;   // slots looked at by lookups
+    uint64_t grows;
+
+    doopa_t(const doopa_t&);
+    doopa_t& operator=(const doopa_t&);
+
+    static uint64_t hash(const chrposlen_t& key)
+    {
+        uint64_t h = key_hash(key);
+
+        return h ? h : 1;
+    }
+
+    uint8_t *alloc(size_t cap) const
+    {
+        uint8_t *p = (uint8_t *)big_alloc(cap * esize);
+
+        if (!p)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    table_entry_t *at(uint8_t *a, uint64_t i) const
+    {
+        return (table_entry_t *)(a + i * esize);
+    }
+
+    /* The first free slot for h, its hash is set. */
+    table_entry_t *place(uint8_t *a, uint64_t m, uint64_t h) const
+    {
+        uint64_t i = h & m;
+
+        while (at(a, i)->hash)
+            i = (i + 1) & m;
+        at(a, i)->hash = h;
+        return at(a, i);
+    }
+
+    /* Move slot i of array a over to the slots, if it is taken. */
+    void move(uint8_t *a, uint64_t i)
+    {
+        if (at(a, i)->hash)
+            memcpy((void *)place(slots, mask, at(a, i)->hash), at(a, i), esize);
+    }
+
+    table_entry_t *probe(uint8_t *a, uint64_t m, uint64_t h, const chrposlen_t& key) const
+    {
+        uint64_t i = h & m;
+
+        while (probes++, at(a, i)->hash) {
+            if (at(a, i)->hash == h && (compact() ||
+                    (at(a, i)->first.lo == key.lo && at(a, i)->first.hi == key.hi)))
+                return at(a, i);
+            i = (i + 1) & m;
         }
+        return NULL;
     }
-    error("Total bases:\t%lld", total_bases);
-    error("Bases above Q30:\t%lld", bases_above_q30);
-    error("Total reads:\t%lld", total_reads);
-    error("Paired reads:\t%lld", paired_reads);
-    error("Mapped reads:\t%lld", mapped_reads);
-    error("Duplicate reads:\t%lld", duplicate_reads);
-    print_frag_stats(&fragment_histogram, paired_reads / 2);
-    error("");
 
-    error("Fragment Histogram:");
-    error("Lower\tUpper\tFrequency");
-    for (fragment_t::iterator frag = fragment_histogram.begin(); frag != fragment_histogram.end(); frag++) {
-        error("%u\t%u\t%u", frag->first * FRAGMENT_BIN_SIZE, frag->first * FRAGMENT_BIN_SIZE + (FRAGMENT_BIN_SIZE - 1), frag->second);
+    /* Entries still in the old array are found there. Nothing is ever
+       taken out of it, so its probe sequences stay whole, and an entry
+       already moved is found in the new array first. */
+    table_entry_t *lookup(uint64_t h, const chrposlen_t& key) const
+    {
+        table_entry_t *e = NULL;
+
+        lookups++;
+        if (slots)
+            e = probe(slots, mask, h, key);
+        if (!e && old)
+            e = probe(old, old_mask, h, key);
+        return e;
     }
 
-    hts_itr_destroy(iter);
+    void grow()
+    {
+        if (!slots) {
+            reserve(0);
+            return;
+        }
+        uint64_t t = trace_begin();
 
-    iter = sam_itr_queryi(idx, HTS_IDX_START, 0, 0);
-    if (!stats_only) {
-        for(total_reads = 0; sam_itr_next(in, iter, b) >= 0; total_reads++) {
-            const bam1_core_t *c = &b->core;
-            if (c->tid < 0) {
-                /* Write unmapped reads as is */
-                if (sam_write1(out, hdr, b) < 0) {
-                    error("writing to standard output failed");
-                    exit(1);
-                }
-                continue;
-            }
-            make_key(&key, b);
-            qualsum = get_qualsum(b, NULL, NULL);
-            if ((qualsum == std::get<1>(mp[key])) && (std::get<0>( mp[key] ) == total_reads)) {
-                if (sam_write1(out, hdr, b) < 0) {
-                    error("writing to standard output failed");
-                    exit(1);
-                }
+        migrate(SIZE_MAX);
+        grows++;
+        old = slots;
+        old_mask = mask;
+        moved = 0;
+        mask = 2 * mask + 1;
+        slots = alloc(mask + 1);
+        trace_end("table grow", t);
+    }
+
+    /* Move up to k slots of the old array over. */
+    void migrate(uint64_t k)
+    {
+        for (; old && k; k--) {
+            move(old, moved);
+            if (++moved > old_mask) {
+                big_free(old, (old_mask + 1) * esize);
+                old = NULL;
             }
         }
     }
-    error("Done");
+};
 
-    bam_destroy1(b);
-    hts_itr_destroy(iter);
+/* With --compact-keys two keys with the same 64-bit hash are taken for
+   the same key. Report how many such pairs to expect among the keys seen,
+   n(n-1)/2 pairs each colliding with probability 2^-64. */
+static void print_collisions(const doopa_t& mp)
+{
+    double n = mp.size();
 
-clean:
-    hts_idx_destroy(idx);
-    bam_hdr_destroy(hdr);
-    sam_close(in);
-    if (sam_close(out) < 0) {
-        error("could not close output file");
-    }
-    if (p.pool) hts_tpool_destroy(p.pool);
+    if (mp.compact())
+        error("Expected key collisions:\t%.3g", n * (n - 1) / 2 / 18446744073709551616.0);
 }
 
-int main(int argc, char **argv)
+typedef std::map<uint64_t, uint64_t> fragment_t;
+
+typedef struct {
+    uint64_t total_reads;
+    uint64_t paired_reads;
+    uint64_t mapped_reads;
+    uint64_t bases_above_q30;
+    uint64_t total_bases;
+    uint64_t duplicate_reads;
+    fragment_t fragment_histogram;
+} dedup_stats_t;
+
+/* Reads with the same key that are still waiting to be written when streaming */
+typedef struct {
+    uint64_t best;
+    uint64_t qualsum;
+    uint32_t pending;
+} group_t;
+
+typedef std::unordered_map<chrposlen_t, group_t,
+        std::function<size_t(const chrposlen_t&)>,
+        std::function<bool(const chrposlen_t&, const chrposlen_t&)>,
+        pool_alloc<std::pair<const chrposlen_t, group_t> > > groups_t;
+
+typedef struct {
+    bam1_t *b;
+    chrposlen_t key;
+    uint64_t serial;
+    uint64_t qualsum;
+    int32_t tid;
+    int32_t start;
+    bool keyed;
+} stream_read_t;
+
+/* A read without an MC tag whose mate comes later in coordinate order.
+   Its key is completed from the mate's own cigar when the mate turns up,
+   or guessed like make_key() does if it is pushed out of the cache first. */
+typedef struct {
+    int32_t tid, mtid;
+    int64_t pos, mpos;
+    uint64_t end;
+    chrposlen_t fallback;
+    uint64_t id;
+    uint64_t qualsum;
+} pending_mate_t;
+
+typedef struct {
+    std::unordered_map<uint64_t, pending_mate_t> pending;
+    std::deque<uint64_t> order; // oldest first, may hold names already taken
+    size_t max;
+    uint64_t found;
+    uint64_t guessed;
+} mate_cache_t;
+
+static uint64_t qname_hash(const char *s)
 {
-    int c;
-    bool statsonly = false;
-    char debugread[128] = {0};
-    char bamfile[1024] = {0};
+    uint64_t h = 0xcbf29ce484222325ULL;
 
-    if (argc < 2) {
-        error("needs indexed bam file as input");
-        return 1;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 0x100000001b3ULL;
     }
+    return h;
+}
 
-    while (1) {
-        int option_index = 0;
-        static struct option long_options[] = {
-            {"statsonly", no_argument,       0, 's' },
-            {"debugread", required_argument, 0, 'd' },
-            {0,           0,                 0,  0  }
-        };
+/* Whether the mate's geometry has to come from the mate itself. */
+static inline bool needs_mate(const bam1_t *b)
+{
+    return b->core.mtid >= 0 && !(b->core.flag & BAM_FMUNMAP) && !bam_aux_get(b, "MC");
+}
 
-        c = getopt_long(argc, argv, "sd:", long_options, &option_index);
-        if (c == -1)
-            break;
+/* Take the pending mate of b out of the cache, if it is there. */
+static bool mate_cache_take(mate_cache_t *mc, const bam1_t *b, pending_mate_t *mate)
+{
+    std::unordered_map<uint64_t, pending_mate_t>::iterator it;
 
-        switch (c) {
-        case 's':
-            statsonly = true;
-            break;
+    it = mc->pending.find(qname_hash(bam_get_qname(b)));
+    if (it == mc->pending.end())
+        return false;
+    const pending_mate_t *m = &it->second;
+    if (m->tid != b->core.mtid || m->pos != b->core.mpos ||
+            m->mtid != b->core.tid || m->mpos != b->core.pos)
+        return false;
+    *mate = *m;
+    mc->pending.erase(it);
+    mc->found++;
+    return true;
+}
 
-        case 'd':
-            snprintf(debugread, 128, optarg);
-            break;
+/* Park b until its mate turns up. Returns true and fills evicted when
+   the oldest read had to make room, it then gets its fallback key. */
+static bool mate_cache_put(mate_cache_t *mc, bam1_t *b, uint64_t id, uint64_t qualsum,
+                           pending_mate_t *evicted)
+{
+    uint64_t h = qname_hash(bam_get_qname(b));
+    pending_mate_t m;
+    bool ret = false;
 
-        default:
-            printf("Invalid option code 0%o\n", c);
-        }
-    }
+    m.tid = b->core.tid;
+    m.pos = b->core.pos;
+    m.mtid = b->core.mtid;
+    m.mpos = b->core.mpos;
+    m.end = pack_end(b);
+    make_key(&m.fallback, b);
+    m.id = id;
+    m.qualsum = qualsum;
 
-    if (optind < argc) {
-        snprintf(bamfile, 1024, argv[optind]);
+    while (!mc->order.empty() && !mc->pending.count(mc->order.front()))
+        mc->order.pop_front();
+    if (mc->pending.size() >= mc->max || mc->pending.count(h)) {
+        uint64_t old = mc->pending.count(h) ? h : mc->order.front();
+        *evicted = mc->pending[old];
+        mc->pending.erase(old);
+        mc->guessed++;
+        ret = true;
     }
+    mc->pending[h] = m;
+    mc->order.push_back(h);
+    return ret;
+}
+
+/* Take b itself out of the cache, when it has to do without its mate. */
+static bool mate_cache_take_read(mate_cache_t *mc, const bam1_t *b, pending_mate_t *self)
+{
+    std::unordered_map<uint64_t, pending_mate_t>::iterator it;
 
-    dedup_bam(bamfile, statsonly, debugread);
+    it = mc->pending.find(qname_hash(bam_get_qname(b)));
+    if (it == mc->pending.end() || it->second.tid != b->core.tid || it->second.pos != b->core.pos)
+        return false;
+    *self = it->second;
+    mc->pending.erase(it);
+    mc->guessed++;
+    return true;
+}
+
+/* Take the oldest read out of the cache, at the end of the input. */
+static bool mate_cache_pop(mate_cache_t *mc, pending_mate_t *m)
+{
+    while (!mc->order.empty()) {
+        std::unordered_map<uint64_t, pending_mate_t>::iterator it = mc->pending.find(mc->order.front());
+        mc->order.pop_front();
+        if (it != mc->pending.end()) {
+            *m = it->second;
+            mc->pending.erase(it);
+            mc->guessed++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void print_mate_stats(const mate_cache_t *mc)
+{
+    if (mc->found || mc->guessed) {
+        error("Mates found without MC:\t%" PRIu64, mc->found);
+        error("Mates guessed without MC:\t%" PRIu64, mc->guessed);
+    }
+}
+
+/* Whether the mate of a read comes after it in coordinate order. */
+static inline bool mate_ahead(const bam1_core_t *c)
+{
+    return c->mtid > c->tid || (c->mtid == c->tid && c->mpos >= c->pos);
+}
+
+/* Add a read to the winner table under key. */
+static inline void add_read(doopa_t *mp, const chrposlen_t& key, uint64_t id, uint64_t qualsum,
+                            dedup_stats_t *st)
+{
+    std::pair<doopa_t::iterator, bool> r = mp->insert(std::make_pair(key, std::make_pair(id, qualsum)));
+
+    if (!r.second) {
+        // Key exists
+        st->duplicate_reads++;
+        if (qualsum > std::get<1>(r.first->second)) {
+            r.first->second = std::make_pair(id, qualsum);
+        }
+    }
+}
+
+/* Add a read of coordinate sorted input to the winner table. Without MC
+   it waits for its mate, if that comes later. */
+static void add_sorted_read(doopa_t *mp, mate_cache_t *mates, bam1_t *b, uint64_t id,
+                            uint64_t qualsum, dedup_stats_t *st)
+{
+    pending_mate_t mate;
+    chrposlen_t key;
+
+    if (needs_mate(b) && mate_cache_take(mates, b, &mate)) {
+        // without MC the mate's geometry comes from the mate itself
+        key.lo = pack_end(b);
+        key.hi = mate.end;
+        add_read(mp, key, id, qualsum, st);
+        key.hi = key.lo;
+        key.lo = mate.end;
+        add_read(mp, key, mate.id, mate.qualsum, st);
+    } else if (needs_mate(b) && mate_ahead(&b->core)) {
+        if (mate_cache_put(mates, b, id, qualsum, &mate))
+            add_read(mp, mate.fallback, mate.id, mate.qualsum, st);
+    } else {
+        make_key(&key, b);
+        add_read(mp, key, id, qualsum, st);
+    }
+}
+
+static inline uint64_t get_qualsum(const bam1_t *b, uint64_t *total, uint64_t *q30)
+{
+    int i;
+    uint64_t sum, q, len;
+    uint8_t *qual = bam_get_qual(b);
+
+    len = b->core.l_qseq;
+    for (i = sum = 0; i < len; ++i) {
+        q = qual[i];
+        sum += q;
+        if (q30 && q >= 30) {
+            (*q30)++;
+        }
+    }
+    if (total)
+        *total += len;
+    return sum;
+}
+
+/* Decoded reads kept in memory between the passes, stored back to back
+   in large pages. Each one is its read id, core, data length and data. */
+typedef struct {
+    std::vector<uint8_t *> pages;
+    std::vector<uint8_t *> records;
+    size_t page_used;
+    uint64_t bytes;
+    uint64_t limit;
+} arena_t;
+
+typedef struct {
+    uint64_t id;
+    bam1_core_t core;
+    int32_t l_data;
+} arena_rec_t;
+
+#define ARENA_REC_SIZE(l_data) ((sizeof(arena_rec_t) + (l_data) + 7) & ~(size_t)7)
+
+static void arena_destroy(arena_t *a)
+{
+    for (size_t i = 0; i < a->pages.size(); i++) {
+        free(a->pages[i]);
+    }
+    std::vector<uint8_t *>().swap(a->pages);
+    std::vector<uint8_t *>().swap(a->records);
+    a->page_used = 0;
+    a->bytes = 0;
+}
+
+/* Append a copy of b, returning its index or -1 once the arena is full. */
+static int64_t arena_push(arena_t *a, const bam1_t *b, uint64_t id)
+{
+    size_t need = ARENA_REC_SIZE(b->l_data);
+    arena_rec_t *r;
+    uint8_t *page;
+
+    if (a->pages.empty() || a->page_used + need > ARENA_PAGE_SIZE) {
+        size_t page_size = need > ARENA_PAGE_SIZE ? need : ARENA_PAGE_SIZE;
+        if (a->bytes + page_size > a->limit)
+            return -1;
+        if (!(page = (uint8_t *)malloc(page_size)))
+            return -1;
+        a->pages.push_back(page);
+        a->page_used = 0;
+        a->bytes += page_size;
+    }
+
+    r = (arena_rec_t *)(a->pages.back() + a->page_used);
+    r->id = id;
+    r->core = b->core;
+    r->l_data = b->l_data;
+    memcpy(r + 1, b->data, b->l_data);
+    a->page_used += need;
+    a->records.push_back((uint8_t *)r);
+    return a->records.size() - 1;
+}
+
+static inline const arena_rec_t *arena_get(const arena_t *a, uint64_t i)
+{
+    return (const arena_rec_t *)a->records[i];
+}
+
+/* Point b at an arena record, b must not own any data. */
+static inline void arena_view(const arena_rec_t *r, bam1_t *b)
+{
+    memset(b, 0, sizeof(*b));
+    b->core = r->core;
+    b->l_data = r->l_data;
+    b->m_data = r->l_data;
+    b->data = (uint8_t *)(r + 1);
+}
+
+/* Estimate the arena size needed for the placed reads: the read count
+   comes from the index, the record size from the first reads in the file.
+   Duplicates count too, every read is kept until pass 1 has picked the
+   winners, so the arena must hold them all. */
+static uint64_t estimate_arena_size(samFile *in, bam_hdr_t *hdr, const hts_idx_t *idx, bam1_t *b)
+{
+    uint64_t mapped, unmapped, n_reads = 0, sampled = 0, bytes = 0;
+    int64_t start = bgzf_tell(in->fp.bgzf);
+    int tid;
+
+    for (tid = 0; tid < hdr->n_targets; tid++) {
+        // references without reads have no stats
+        if (hts_idx_get_stat(idx, tid, &mapped, &unmapped) == 0)
+            n_reads += mapped + unmapped;
+    }
+    if (!n_reads)
+        return 0;
+    while (sampled < ARENA_SAMPLE_READS && sam_read1(in, hdr, b) >= 0 && b->core.tid >= 0) {
+        bytes += ARENA_REC_SIZE(b->l_data);
+        sampled++;
+    }
+    if (bgzf_seek(in->fp.bgzf, start, SEEK_SET) < 0 || !sampled)
+        return 0;
+
+    return n_reads * (bytes / sampled + sizeof(uint8_t *));
+}
+
+/* Parse a size such as 512M or 4G. */
+static uint64_t parse_size(const char *str)
+{
+    char *end;
+    double size = strtod(str, &end);
+
+    switch (toupper((int)*end)) {
+        case 'G': size *= 1024; // fall through
+        case 'M': size *= 1024; // fall through
+        case 'K': size *= 1024;
+    }
+    return size < 0 ? 0 : (uint64_t)size;
+}
+
+void print_frag_stats(fragment_t *frag_hist, uint64_t total_fragments)
+{
+    float half_dist = total_fragments * 0.5f;
+    float csum = 0.f;
+    float dist = 0.f;
+    float mean = 0.f;
+    float stdev = 0.f;
+    float cstd = 0.f;
+    float median = 0.f;
+    int found = 0;
+
+    for (fragment_t::iterator frag = frag_hist->begin(); frag != frag_hist->end(); frag++) {
+        float mi = (float)frag->first * (float)FRAGMENT_BIN_SIZE + (float)FRAGMENT_BIN_SIZE * 0.5f;
+        float curr = mi * (float)frag->second;
+        dist += (float)frag->second;
+        csum += curr;
+        if (!found && (dist >= half_dist)) {
+            /* L + ( (n/2 – F) / f ) * w */
+            median = ((float)frag->first * (float)FRAGMENT_BIN_SIZE) + ((half_dist - dist) / (float)frag->second) * (float)FRAGMENT_BIN_SIZE;
+            found = 1;
+        }
+    }
+    mean = csum / (float)total_fragments;
+
+    for (fragment_t::iterator frag = frag_hist->begin(); frag != frag_hist->end(); frag++) {
+        float mi = (float)frag->first * (float)FRAGMENT_BIN_SIZE + (float)FRAGMENT_BIN_SIZE * 0.5f;
+        float cmu = mi - mean;
+        cstd += (float)frag->second * cmu * cmu;
+    }
+    stdev = sqrt(cstd / ((float)total_fragments - 1.f));
+
+    error("Mean fragment size: %.4f", mean);
+    error("Median fragment size: %.0f", median);
+    error("Stdev fragment size: %.4f", stdev);
+}
+
+typedef struct {
+    bool stats_only;
+    const char *debugread;
+    const char *out_fmt;
+    uint64_t max_memory;
+    int32_t window;
+    bool queryname;
+    const char *out_file;
+    bool sort;
+    bool write_index;
+    const char *reference;
+    bool mmap;
+    int prefetch;
+    bool sidecar;
+    const char *pass1_only;
+    const char *from_pass1;
+    const char *checkpoint;
+    char **regions;
+    int n_regions;
+    const char *regions_file;
+    int shard;          // from 1, with n_shards
+    int n_shards;
+    int threads;
+    bool numa;
+    bool compact_keys;
+    bool profile;
+    const char *profile_json;
+    const char *trace;
+} doopa_opts_t;
+
+/* Only primary, mapped reads that passed QC are deduplicated and written. */
+static inline bool is_candidate(const bam1_core_t *c)
+{
+    // read must not be secondary, supplementary, unmapped or failed QC
+    return c->tid >= 0 &&
+           !(c->flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY | BAM_FUNMAP | BAM_FQCFAIL));
+}
+
+/* Count a placed read, returning whether it takes part in deduplication. */
+static bool count_read(dedup_stats_t *st, const bam1_t *b)
+{
+    const bam1_core_t *c = &b->core;
+    uint64_t fragment_bin;
+
+    if (!is_candidate(c)) {
+        return false;
+    }
+    st->mapped_reads++;
+    if (c->mtid >= 0) {
+        if ((c->flag & BAM_FPROPER_PAIR) &&
+                c->isize > 0 && c->qual > 30) {
+            if (c->isize > MAX_FRAGMENT_SIZE) {
+                fragment_bin = MAX_FRAGMENT_SIZE / FRAGMENT_BIN_SIZE;
+            } else {
+                fragment_bin = c->isize / FRAGMENT_BIN_SIZE;
+            }
+            st->fragment_histogram[fragment_bin]++;
+            st->paired_reads += 2;
+        }
+    }
+    return true;
+}
+
+/* Add the statistics of part of the input to those of the whole. */
+static void merge_stats(dedup_stats_t *st, const dedup_stats_t *part)
+{
+    st->total_reads += part->total_reads;
+    st->paired_reads += part->paired_reads;
+    st->mapped_reads += part->mapped_reads;
+    st->bases_above_q30 += part->bases_above_q30;
+    st->total_bases += part->total_bases;
+    st->duplicate_reads += part->duplicate_reads;
+    for (fragment_t::const_iterator it = part->fragment_histogram.begin();
+            it != part->fragment_histogram.end(); it++) {
+        st->fragment_histogram[it->first] += it->second;
+    }
+}
+
+static void print_stats(dedup_stats_t *st)
+{
+    error("Total bases:\t%lld", st->total_bases);
+    error("Bases above Q30:\t%lld", st->bases_above_q30);
+    error("Total reads:\t%lld", st->total_reads);
+    error("Paired reads:\t%lld", st->paired_reads);
+    error("Mapped reads:\t%lld", st->mapped_reads);
+    error("Duplicate reads:\t%lld", st->duplicate_reads);
+    print_frag_stats(&st->fragment_histogram, st->paired_reads / 2);
+    error("");
+
+    error("Fragment Histogram:");
+    error("Lower\tUpper\tFrequency");
+    for (fragment_t::iterator frag = st->fragment_histogram.begin(); frag != st->fragment_histogram.end(); frag++) {
+        error("%u\t%u\t%u", frag->first * FRAGMENT_BIN_SIZE, frag->first * FRAGMENT_BIN_SIZE + (FRAGMENT_BIN_SIZE - 1), frag->second);
+    }
+}
+
+/* Point a cram file at the reference. All cram files, inputs and output,
+   share the first one's reference cache, so each sequence is loaded once.
+   In pass 1 only the fields deduplication needs are decoded. */
+static void cram_setup(samFile *fp, const doopa_opts_t *opts, bool pass1)
+{
+    static refs_t *refs = NULL;
+
+    if (fp->format.format != cram)
+        return;
+    if (refs) {
+        hts_set_opt(fp, CRAM_OPT_SHARED_REF, refs);
+    } else {
+        if (opts->reference)
+            hts_set_opt(fp, CRAM_OPT_REFERENCE, opts->reference);
+        refs = cram_get_refs(fp);
+    }
+    if (pass1)
+        hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, PASS1_FIELDS);
+}
+
+/* The CPUs the cgroup v2 quotas allow: the smallest quota from doopa's
+   cgroup up to the root, as each level caps those below it. Returns 0 if
+   there is no quota and -1 if there is no cgroup v2. */
+static int cgroup2_cpus(void)
+{
+    char dir[4000] = "", path[4096], max[32], *slash;
+    long long quota, period;
+    int n = 0, k;
+    bool v2 = false;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/cgroup", "r"))) {
+        while (fgets(dir, sizeof(dir), fp)) {
+            if (!strncmp(dir, "0::", 3))
+                break;
+        }
+        if (!strncmp(dir, "0::", 3)) {
+            dir[strcspn(dir, "\n")] = 0;
+            memmove(dir, dir + 3, strlen(dir + 3) + 1);
+        } else {
+            dir[0] = 0;
+        }
+        fclose(fp);
+    }
+    // "quota period" or "max period" in cpu.max
+    for (;;) {
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", dir);
+        if ((fp = fopen(path, "r"))) {
+            v2 = true;
+            if (fscanf(fp, "%31s %lld", max, &period) == 2 && strcmp(max, "max") &&
+                    (quota = atoll(max)) > 0 && period > 0) {
+                k = (quota + period - 1) / period;
+                n = n ? std::min(n, k) : k;
+            }
+            fclose(fp);
+        }
+        if (!(slash = strrchr(dir, '/')))
+            break;
+        *slash = 0;
+    }
+    return v2 ? n : -1;
+}
+
+/* How many CPUs doopa may use: those of its affinity mask, and no more
+   than the CPU quota of its cgroup allows. */
+static int available_cpus(void)
+{
+    long long quota = 0, period = 0;
+    cpu_set_t set;
+    FILE *fp;
+    int n = sysconf(_SC_NPROCESSORS_ONLN), k;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        n = CPU_COUNT(&set);
+
+    if ((k = cgroup2_cpus()) > 0) {
+        n = std::min(n, k);
+    } else if (k < 0 && (fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r"))) {
+        // cgroup v1, a quota of -1 is none
+        if (fscanf(fp, "%lld", &quota) != 1)
+            quota = 0;
+        fclose(fp);
+        if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r"))) {
+            if (fscanf(fp, "%lld", &period) != 1)
+                period = 0;
+            fclose(fp);
+        }
+        if (quota > 0 && period > 0)
+            n = std::min(n, (int)((quota + period - 1) / period));
+    }
+    return std::max(n, 1);
+}
+
+/* Parse -@: a number of threads, or auto for as many as there are CPUs
+   to use. Returns 0 if it is neither. */
+static int parse_threads(const char *str)
+{
+    int n;
+
+    if (!strcmp(str, "auto")) {
+        n = available_cpus();
+        error("Using %d threads", n);
+        return n;
+    }
+    return atoi(str);
+}
+
+/* Read a list like "0-3,8-11" of CPUs or nodes from a sysfs file. */
+static std::vector<int> read_cpulist(const char *path)
+{
+    std::vector<int> list;
+    char line[4096], *s = line;
+    long first, last;
+    FILE *fp;
+
+    if (!(fp = fopen(path, "r")))
+        return list;
+    if (fgets(line, sizeof(line), fp)) {
+        while (isdigit((int)*s)) {
+            first = last = strtol(s, &s, 10);
+            if (*s == '-')
+                last = strtol(s + 1, &s, 10);
+            for (long i = first; i <= last; i++)
+                list.push_back(i);
+            if (*s == ',')
+                s++;
+        }
+    }
+    fclose(fp);
+    return list;
+}
+
+/* With --numa, interleave the memory doopa allocates from now on over all
+   nodes page by page. Pass 1 fills the winner table from a single thread,
+   which would otherwise place all of it on the node that thread started on.
+   Returns the number of nodes. */
+static int numa_init(void)
+{
+    std::vector<int> nodes = read_cpulist("/sys/devices/system/node/online");
+    unsigned long mask[16] = {0};
+
+    if (nodes.size() < 2)
+        return nodes.size();
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i] < (int)(sizeof(mask) * 8))
+            mask[nodes[i] / (sizeof(long) * 8)] |= 1UL << (nodes[i] % (sizeof(long) * 8));
+    }
+    if (syscall(SYS_set_mempolicy, MPOL_INTERLEAVE, mask, sizeof(mask) * 8) < 0)
+        error("interleaving memory over %d nodes failed: %s", (int)nodes.size(), strerror(errno));
+    return nodes.size();
+}
+
+/* With --numa, pin every thread but the main one to a CPU of its own,
+   taking the CPUs of each node in turn so that the threads are spread
+   evenly over the sockets instead of migrating between them. */
+static void pin_threads(void)
+{
+    std::vector<int> nodes = read_cpulist("/sys/devices/system/node/online");
+    std::vector<std::vector<int> > node_cpus;
+    std::vector<int> cpus, tids;
+    cpu_set_t allowed, set;
+    struct dirent *de;
+    char path[256];
+    DIR *d;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes[i]);
+        std::vector<int> list = read_cpulist(path), usable;
+        for (size_t j = 0; j < list.size(); j++) {
+            if (list[j] < CPU_SETSIZE && CPU_ISSET(list[j], &allowed))
+                usable.push_back(list[j]);
+        }
+        if (!usable.empty())
+            node_cpus.push_back(usable);
+    }
+    for (size_t j = 0; !node_cpus.empty(); j++) {
+        size_t left = 0;
+        for (size_t i = 0; i < node_cpus.size(); i++) {
+            if (j < node_cpus[i].size()) {
+                cpus.push_back(node_cpus[i][j]);
+                left++;
+            }
+        }
+        if (!left)
+            break;
+    }
+    if (cpus.empty() || !(d = opendir("/proc/self/task")))
+        return;
+    while ((de = readdir(d))) {
+        if (isdigit((int)de->d_name[0]) && atoi(de->d_name) != getpid())
+            tids.push_back(atoi(de->d_name));
+    }
+    closedir(d);
+    std::sort(tids.begin(), tids.end());
+    for (size_t i = 0; i < tids.size(); i++) {
+        CPU_ZERO(&set);
+        CPU_SET(cpus[i % cpus.size()], &set);
+        sched_setaffinity(tids[i], sizeof(set), &set);
+    }
+}
+
+/* Create the thread pool of a run, shared by the inputs and the output. */
+static int threads_init(htsThreadPool *p, const doopa_opts_t *opts)
+{
+    if (!(p->pool = hts_tpool_init(opts->threads)))
+        return -1;
+    p->qsize = 2 * opts->threads;
+    if (opts->numa)
+        pin_threads();
+    return 0;
+}
+
+/* The inputs and output start threads of their own when they are opened
+   (htslib's readers and writers, the prefetch reads), pin those too before
+   a pass starts. */
+static void pin_opened_threads(const doopa_opts_t *opts)
+{
+    if (opts->numa)
+        pin_threads();
+}
+
+/* The output as messages name it. */
+static const char *out_name(const doopa_opts_t *opts)
+{
+    return opts->out_file ? opts->out_file : "standard output";
+}
+
+/* Open the output file, or standard output, in the requested format,
+   sharing the thread pool. Compressed output gets a longer queue than
+   the inputs, so more of the threads go to it when both are busy. */
+static samFile *open_output(const doopa_opts_t *opts, htsThreadPool *p)
+{
+    const char *filename = opts->out_file ? opts->out_file : "/dev/stdout";
+    char out_mode[8] = "w";
+    samFile *out;
+
+    if (sam_open_mode(out_mode + 1, filename, opts->out_fmt) < 0) {
+        error("unknown output format \"%s\"", opts->out_fmt);
+        return NULL;
+    }
+    out = sam_open(filename, out_mode);
+    if (out == NULL) {
+        if (opts->out_file)
+            error("Couldn't open \"%s\" for writing", filename);
+        else
+            error("reopening standard output failed");
+        return NULL;
+    }
+    htsThreadPool po = *p;
+    if (out->format.compression != no_compression)
+        po.qsize = p->qsize * ENCODE_WEIGHT;
+    hts_set_opt(out, HTS_OPT_THREAD_POOL, &po);
+    cram_setup(out, opts, false);
+    return out;
+}
+
+/* Find where the unplaced (tid < 0) reads start, as recorded by the index.
+   Returns 0 if the index does not know or there are no such reads. */
+static uint64_t unplaced_offset(const hts_idx_t *idx)
+{
+    hts_itr_t *iter;
+    uint64_t off = 0;
+
+    if (hts_idx_get_n_no_coor(idx) == 0)
+        return 0;
+
+    iter = sam_itr_queryi(idx, HTS_IDX_NOCOOR, 0, 0);
+    if (iter) {
+        if (!iter->finished)
+            off = iter->curr_off;
+        hts_itr_destroy(iter);
+    }
+    return off;
+}
+
+/* Copy the rest of the decompressed bam record stream of in to out,
+   without decoding any records. Returns the number of records copied. */
+static int64_t copy_bam_tail(BGZF *in, BGZF *out)
+{
+    uint8_t buf[BGZF_MAX_BLOCK_SIZE];
+    uint8_t len[4];
+    int64_t n_records = 0;
+    uint64_t skip = 0; // bytes left of the current record
+    int have = 0;      // bytes seen of the current record's length
+    ssize_t n, i, k;
+
+    while ((n = bgzf_read(in, buf, sizeof(buf))) > 0) {
+        if (bgzf_write(out, buf, n) != n)
+            return -1;
+        for (i = 0; i < n; ) {
+            if (skip) {
+                k = (uint64_t)(n - i) < skip ? n - i : (ssize_t)skip;
+                skip -= k;
+                i += k;
+                continue;
+            }
+            len[have++] = buf[i++];
+            if (have == 4) {
+                skip = len[0] | (len[1] << 8) | (len[2] << 16) | ((uint32_t)len[3] << 24);
+                have = 0;
+                n_records++;
+            }
+        }
+    }
+    return n < 0 ? -1 : n_records;
+}
+
+/* Write the arena reads with the given sorted indices. */
+static int write_arena_survivors(samFile *out, bam_hdr_t *hdr, const arena_t *a,
+                                 const std::vector<uint64_t>& survivors)
+{
+    bam1_t view;
+
+    for (size_t i = 0; i < survivors.size(); i++) {
+        arena_view(arena_get(a, survivors[i]), &view);
+        if (sam_write1(out, hdr, &view) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Write all unplaced reads, which follow the last placed one. */
+static int write_unplaced(samFile *in, samFile *out, bam_hdr_t *hdr, bam1_t *b,
+                          uint64_t unplaced_off)
+{
+    int ret;
+
+    if (unplaced_off) {
+        if (bgzf_seek(in->fp.bgzf, unplaced_off, SEEK_SET) < 0)
+            return -1;
+        if (out->format.format == bam)
+            return copy_bam_tail(in->fp.bgzf, out->fp.bgzf) < 0 ? -1 : 0;
+    }
+    // without an offset read on from the last survivor
+    while ((ret = sam_read1(in, hdr, b)) >= 0) {
+        if (b->core.tid >= 0)
+            continue;
+        if (sam_write1(out, hdr, b) < 0)
+            return -1;
+    }
+    return ret < -1 ? -1 : 0;
+}
+
+/* Whether the @HD line of the header has a field starting with field, such as "SO:unsorted". */
+static bool header_hd_has(bam_hdr_t *hdr, const char *field)
+{
+    const char *line = sam_hdr_str(hdr), *end;
+    size_t len = strlen(field);
+
+    if (!line || strncmp(line, "@HD\t", 4))
+        return false;
+    end = strchr(line, '\n');
+    if (!end)
+        end = line + strlen(line);
+    for (const char *t = line; t && t < end; t = strchr(t + 1, '\t')) {
+        if (!strncmp(t + 1, field, len))
+            return true;
+    }
+    return false;
+}
+
+/* Whether the header says reads are grouped by name rather than sorted by position. */
+static bool header_grouped_by_name(bam_hdr_t *hdr)
+{
+    return header_hd_has(hdr, "SO:queryname") || header_hd_has(hdr, "GO:query");
+}
+
+/* Whether the header says reads are sorted by position. A stream is read
+   once, so this is all there is to go by before the reads. */
+static bool header_coordinate_sorted(bam_hdr_t *hdr)
+{
+    return header_hd_has(hdr, "SO:coordinate");
+}
+
+/* Write the name groups starting at the given sorted virtual offsets. Groups in
+   keep have their candidate reads written, groups in unplaced all of their reads. */
+static int write_groups(samFile *in, samFile *out, bam_hdr_t *hdr,
+                        const std::vector<uint64_t>& keep, const std::vector<uint64_t>& unplaced)
+{
+    BGZF *fp = in->fp.bgzf;
+    bam1_t *b = bam_init1(), *next = bam_init1();
+    uint64_t pos, next_pos = 0, target;
+    size_t i = 0, j = 0;
+    bool have_next = false, all;
+    int ret = -1, got = -1;
+
+    if (!b || !next)
+        goto out;
+
+    while (i < keep.size() || j < unplaced.size()) {
+        all = i == keep.size() || (j < unplaced.size() && unplaced[j] < keep[i]);
+        target = all ? unplaced[j++] : keep[i++];
+
+        // find the first read of the group
+        if (have_next && next_pos == target) {
+            std::swap(b, next);
+        } else {
+            pos = bgzf_tell(fp);
+            if (pos > target || (target >> 16) - (pos >> 16) >= SEEK_GAP) {
+                if (bgzf_seek(fp, target, SEEK_SET) < 0)
+                    goto out;
+                pos = target;
+            }
+            for (;;) {
+                if (sam_read1(in, hdr, b) < 0)
+                    goto out;
+                if (pos == target)
+                    break;
+                pos = bgzf_tell(fp);
+            }
+        }
+        have_next = false;
+
+        // then the rest of it, which ends at the first read with another name
+        for (;;) {
+            if ((all || is_candidate(&b->core)) && sam_write1(out, hdr, b) < 0)
+                goto out;
+            next_pos = bgzf_tell(fp);
+            if ((got = sam_read1(in, hdr, next)) < -1)
+                goto out;
+            if (got < 0 || strcmp(bam_get_qname(b), bam_get_qname(next)))
+                break;
+            std::swap(b, next);
+        }
+        have_next = got >= 0;
+    }
+    ret = 0;
+
+out:
+    if (b) bam_destroy1(b);
+    if (next) bam_destroy1(next);
+    return ret;
+}
+
+/* Deduplicate input grouped by read name. Both mates of a pair are seen together,
+   so the key is built from the exact unclipped ends of both and the pair with
+   the highest quality sum wins. The output keeps the input order. */
+static void dedup_queryname(const char *filename, const doopa_opts_t *opts)
+{
+    htsThreadPool p = {NULL, 0};
+    dedup_stats_t st = {0};
+    uint64_t qualsum, voffset, group_off = 0, ends[2];
+    int n_ends = 0, n_placed = 0, n_reads = 0, ret;
+    chrposlen_t key, single_key;
+    char name[256] = {0};
+    bam1_t *b = NULL;
+    bam_hdr_t *hdr = NULL;
+    samFile *out = NULL;
+    samFile *in = NULL;
+    doopa_t mp(1000000, opts->compact_keys);
+    doopa_t::iterator it;
+    std::vector<uint64_t> survivors, unplaced;
+
+    in = sam_open(filename, "r");
+    if (!in) {
+        error("Couldn't open \"%s\"", filename);
+        exit(1);
+    }
+
+    if (threads_init(&p, opts) < 0) {
+        error("error creating thread pool");
+        goto clean;
+    }
+    hts_set_opt(in, HTS_OPT_THREAD_POOL, &p);
+
+    if (!(out = open_output(opts, &p)))
+        goto clean;
+
+    hdr = sam_hdr_read(in);
+    if (hdr == NULL) {
+        errno = 0; error("reading headers from \"%s\" failed", filename);
+        goto clean;
+    }
+
+    if (!opts->stats_only) {
+        if (sam_hdr_write(out, hdr) != 0) {
+            error("writing headers to %s failed", out_name(opts));
+            goto clean;
+        }
+    }
+
+    b = bam_init1();
+    if (b == NULL) { error("can't create record"); exit(1); }
+
+    pin_opened_threads(opts);
+    error("Start deduping by name...");
+
+    qualsum = 0;
+    for (;;) {
+        voffset = bgzf_tell(in->fp.bgzf);
+        if ((ret = sam_read1(in, hdr, b)) < -1) {
+            error("reading \"%s\" failed", filename);
+            exit(1);
+        }
+
+        // a new name closes the previous group
+        if (n_reads && (ret < 0 || strcmp(name, bam_get_qname(b)))) {
+            if (n_ends) {
+                if (n_ends == 2) {
+                    key.lo = ends[0] < ends[1] ? ends[0] : ends[1];
+                    key.hi = ends[0] < ends[1] ? ends[1] : ends[0];
+                } else {
+                    // the mate was not seen, fall back to what the read says about it
+                    key = single_key;
+                }
+                it = mp.find(key);
+                if (it != mp.end()) {
+                    st.duplicate_reads += n_ends;
+                    if (qualsum > std::get<1>(it->second)) {
+                        it->second = std::make_pair(group_off, qualsum);
+                    }
+                } else {
+                    mp[key] = std::make_pair(group_off, qualsum);
+                }
+            } else if (!n_placed) {
+                unplaced.push_back(group_off);
+            }
+            n_reads = n_ends = n_placed = 0;
+            qualsum = 0;
+        }
+        if (ret < 0)
+            break;
+
+        st.total_reads++;
+        if (*opts->debugread && !strncmp((const char *)b->data, opts->debugread, 128)) {
+            error("found debugread %s", opts->debugread);
+        }
+        if (!n_reads++) {
+            group_off = voffset;
+            snprintf(name, sizeof(name), "%s", bam_get_qname(b));
+        }
+        if (b->core.tid < 0)
+            continue;
+        n_placed++;
+        if (!count_read(&st, b))
+            continue;
+        qualsum += get_qualsum(b, &st.total_bases, &st.bases_above_q30);
+        if (n_ends < 2)
+            ends[n_ends] = pack_end(b);
+        if (!n_ends++)
+            make_key(&single_key, b);
+    }
+    print_stats(&st);
+    print_collisions(mp);
+
+    if (!opts->stats_only) {
+        survivors.reserve(mp.size());
+        for (it = mp.begin(); it != mp.end(); it++) {
+            survivors.push_back(std::get<0>(it->second));
+        }
+        mp.clear();
+        std::sort(survivors.begin(), survivors.end());
+
+        if (write_groups(in, out, hdr, survivors, unplaced) < 0) {
+            error("writing to %s failed", out_name(opts));
+            exit(1);
+        }
+    }
+    error("Done");
+
+clean:
+    if (b) bam_destroy1(b);
+    bam_hdr_destroy(hdr);
+    sam_close(in);
+    if (sam_close(out) < 0) {
+        error("could not close output file");
+    }
+    if (p.pool) hts_tpool_destroy(p.pool);
+}
+
+/* Reads sam text straight from the file a line at a time, without the htslib
+   parser. Only what deduplication needs is parsed out of each line, the line
+   itself is kept so that survivors can be parsed in full later. */
+typedef struct {
+    hFILE *fp;
+    char *buf;
+    size_t size, len, pos;  // capacity, bytes held and bytes used up
+    int64_t buf_off;        // file offset of buf[0]
+    int64_t line_off;       // file offset of the last line read
+    int64_t n_line;         // lines read, that one included
+    bool eof;
+    int32_t last_tid;
+    std::string last_ref;
+} sam_text_t;
+
+/* Whether an input is uncompressed sam text, which sam_text_t can read. */
+static inline bool is_sam_text(samFile *fp)
+{
+    const htsFormat *f = hts_get_format(fp);
+    return f->format == sam && f->compression == no_compression;
+}
+
+static sam_text_t *sam_text_init(hFILE *fp)
+{
+    sam_text_t *t = new sam_text_t();
+
+    t->fp = fp;
+    t->size = SAM_BUF_SIZE;
+    if (!(t->buf = (char *)malloc(t->size))) {
+        delete t;
+        return NULL;
+    }
+    t->last_tid = -1;
+    return t;
+}
+
+static void sam_text_destroy(sam_text_t *t)
+{
+    if (t) {
+        free(t->buf);
+        delete t;
+    }
+}
+
+/* Find the end of the line at s and the first SAM_MAX_TABS tabs in it,
+   comparing sixteen bytes at a time where SSE2 is there. Returns the length
+   of the line, or -1 if it does not end before s + n. */
+static ssize_t sam_text_scan(const char *s, size_t n, uint32_t *tabs, int *n_tabs)
+{
+    size_t i = 0;
+    int k = 0;
+
+#ifdef __SSE2__
+    const __m128i tab = _mm_set1_epi8('\t'), nl = _mm_set1_epi8('\n');
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        unsigned mt = _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab));
+        unsigned mn = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+
+        if (mn)
+            mt &= (mn & -mn) - 1; // only the tabs before the newline
+        for (; mt && k < SAM_MAX_TABS; mt &= mt - 1)
+            tabs[k++] = i + __builtin_ctz(mt);
+        if (mn) {
+            *n_tabs = k;
+            return i + __builtin_ctz(mn);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (s[i] == '\n') {
+            *n_tabs = k;
+            return i;
+        }
+        if (s[i] == '\t' && k < SAM_MAX_TABS)
+            tabs[k++] = i;
+    }
+    *n_tabs = k;
+    return -1;
+}
+
+/* Find the next line, reading more of the file as needed, and end it with
+   a NUL in place. Returns its length, -1 at the end and -2 on error. */
+static ssize_t sam_text_line(sam_text_t *t, char **line, uint32_t *tabs, int *n_tabs)
+{
+    ssize_t len, n;
+
+    for (;;) {
+        len = sam_text_scan(t->buf + t->pos, t->len - t->pos, tabs, n_tabs);
+        if (len >= 0)
+            break;
+        if (t->eof) {
+            if (t->pos == t->len)
+                return -1;
+            len = t->len - t->pos; // the last line has no newline
+            break;
+        }
+        // keep the partial line and read more after it
+        if (t->pos) {
+            memmove(t->buf, t->buf + t->pos, t->len - t->pos);
+            t->buf_off += t->pos;
+            t->len -= t->pos;
+            t->pos = 0;
+        }
+        if (t->len + 1 >= t->size) {
+            char *buf = (char *)realloc(t->buf, t->size * 2);
+            if (!buf)
+                return -2;
+            t->buf = buf;
+            t->size *= 2;
+        }
+        if ((n = hread(t->fp, t->buf + t->len, t->size - t->len - 1)) < 0)
+            return -2;
+        t->eof = n == 0;
+        t->len += n;
+    }
+    *line = t->buf + t->pos;
+    (*line)[len] = '\0';
+    t->line_off = t->buf_off + t->pos;
+    t->pos = std::min(t->pos + len + 1, t->len);
+    t->n_line++;
+    return len;
+}
+
+/* Read the header lines at the start of the file. */
+static bam_hdr_t *sam_text_header(sam_text_t *t)
+{
+    uint32_t tabs[SAM_MAX_TABS];
+    std::string text;
+    ssize_t len;
+    char *line;
+    int n_tabs;
+
+    while ((len = sam_text_line(t, &line, tabs, &n_tabs)) >= 0) {
+        if (*line != '@') {
+            // the first read, leave it for sam_text_read()
+            line[len] = '\n';
+            t->pos = t->line_off - t->buf_off;
+            t->n_line--;
+            break;
+        }
+        text.append(line, len);
+        text += '\n';
+    }
+    if (len < -1)
+        return NULL;
+    return sam_hdr_parse(text.size(), text.c_str());
+}
+
+/* Look up a reference name, remembering the last one since reads come
+   grouped by reference. */
+static int32_t sam_text_tid(sam_text_t *t, bam_hdr_t *hdr, const char *name, size_t len)
+{
+    if (len == 1 && *name == '*')
+        return -1;
+    if (len != t->last_ref.size() || memcmp(name, t->last_ref.data(), len)) {
+        t->last_ref.assign(name, len);
+        t->last_tid = sam_hdr_name2tid(hdr, t->last_ref.c_str());
+        if (t->last_tid < 0)
+            error("unknown reference \"%s\"", t->last_ref.c_str());
+    }
+    return t->last_tid < 0 ? -2 : t->last_tid;
+}
+
+/* Parse a numeric field of a sam line, which must be all digits and
+   within lo and hi. */
+static bool sam_text_num(const char *f, size_t len, int64_t lo, int64_t hi, int64_t *v)
+{
+    char *end;
+
+    if (!len || !(isdigit((int)*f) || *f == '-'))
+        return false;
+    errno = 0;
+    *v = strtoll(f, &end, 10);
+    return end == f + len && errno != ERANGE && *v >= lo && *v <= hi;
+}
+
+/* Read the next line into b, with only the parts deduplication looks at:
+   the core, name, cigar, qualities and MC tag. The sequence is not encoded.
+   The line is kept after the record's data for sam_text_full().
+   Returns 0 on success, -1 at the end and < -1 on error. */
+static int sam_text_read(sam_text_t *t, bam_hdr_t *hdr, bam1_t *b)
+{
+    uint32_t tabs[SAM_MAX_TABS];
+    const char *f[12], *p, *mc = NULL;
+    size_t flen[12], mc_len = 0, l_qname, extranul, l_aux, need;
+    uint32_t n_cigar = 0, *cigar;
+    int32_t l_qseq;
+    int64_t flag, pos, mapq, mpos, isize;
+    ssize_t len;
+    char *line;
+    uint8_t *d;
+    int n_tabs, i;
+
+    if ((len = sam_text_line(t, &line, tabs, &n_tabs)) < 0)
+        return len;
+    if (n_tabs < 10) {
+        error("sam line has too few fields");
+        return -2;
+    }
+    for (i = 0; i < 11; i++) {
+        f[i] = line + (i ? tabs[i - 1] + 1 : 0);
+        flen[i] = (i < n_tabs ? line + tabs[i] : line + len) - f[i];
+    }
+    // MC is the only tag needed
+    for (i = 10; i < n_tabs && !mc; i++) {
+        p = line + tabs[i] + 1;
+        if (!strncmp(p, "MC:Z:", 5)) {
+            mc = p + 5;
+            mc_len = strcspn(mc, "\t");
+        }
+    }
+    if (!mc && n_tabs == SAM_MAX_TABS && (p = strstr(line + tabs[n_tabs - 1], "\tMC:Z:"))) {
+        mc = p + 6;
+        mc_len = strcspn(mc, "\t");
+    }
+
+    bam1_core_t *c = &b->core;
+    if ((c->tid = sam_text_tid(t, hdr, f[2], flen[2])) < -1)
+        return -2;
+    if (flen[6] == 1 && *f[6] == '=') {
+        c->mtid = c->tid;
+    } else if (flen[6] == 1 && *f[6] == '*') {
+        c->mtid = -1;
+    } else {
+        std::string ref(f[6], flen[6]);
+        if ((c->mtid = sam_hdr_name2tid(hdr, ref.c_str())) < 0) {
+            error("unknown reference \"%s\"", ref.c_str());
+            return -2;
+        }
+    }
+    if (!sam_text_num(f[1], flen[1], 0, UINT16_MAX, &flag) ||
+            !sam_text_num(f[3], flen[3], 0, INT32_MAX, &pos) ||
+            !sam_text_num(f[4], flen[4], 0, UINT8_MAX, &mapq) ||
+            !sam_text_num(f[7], flen[7], 0, INT32_MAX, &mpos) ||
+            !sam_text_num(f[8], flen[8], -INT32_MAX, INT32_MAX, &isize)) {
+        error("bad flag, position, mapping quality or template length on line %" PRId64, t->n_line);
+        return -2;
+    }
+    c->flag = flag;
+    c->pos = pos - 1;
+    c->qual = mapq;
+    c->mpos = mpos - 1;
+    c->isize = isize;
+    c->bin = 0;
+
+    if (!(flen[5] == 1 && *f[5] == '*')) {
+        for (p = f[5]; p < f[5] + flen[5]; p++) {
+            n_cigar += !isdigit((int)*p);
+        }
+    }
+    l_qseq = flen[9] == 1 && *f[9] == '*' ? 0 : flen[9];
+    if (!(flen[10] == 1 && *f[10] == '*') && (int32_t)flen[10] != l_qseq) {
+        error("sam line has a different number of bases and qualities");
+        return -2;
+    }
+    l_qname = flen[0] + 1;
+    extranul = (4 - l_qname % 4) % 4;
+    l_aux = mc ? 3 + mc_len + 1 : 0;
+
+    b->l_data = l_qname + extranul + n_cigar * 4 + (l_qseq + 1) / 2 + l_qseq + l_aux;
+    need = b->l_data + len + 1;
+    if (need > b->m_data) {
+        if (!(d = (uint8_t *)realloc(b->data, need)))
+            return -2;
+        b->data = d;
+        b->m_data = need;
+    }
+    c->l_qname = l_qname + extranul;
+    c->l_extranul = extranul;
+    c->n_cigar = n_cigar;
+    c->l_qseq = l_qseq;
+
+    d = b->data;
+    memcpy(d, f[0], flen[0]);
+    memset(d + flen[0], 0, 1 + extranul);
+    cigar = bam_get_cigar(b);
+    for (p = f[5], i = 0; i < (int)n_cigar; i++) {
+        char *end;
+        uint32_t oplen = strtoul(p, &end, 10);
+        const char *op = strchr(BAM_CIGAR_STR, *end);
+        if (!op || !*end) {
+            error("bad cigar in sam line");
+            return -2;
+        }
+        cigar[i] = bam_cigar_gen(oplen, op - BAM_CIGAR_STR);
+        p = end + 1;
+    }
+    memset(bam_get_seq(b), 0, (l_qseq + 1) / 2);
+    d = bam_get_qual(b);
+    if (l_qseq && *f[10] == '*' && flen[10] == 1) {
+        memset(d, 0xff, l_qseq);
+    } else {
+        for (i = 0; i < l_qseq; i++) {
+            d[i] = f[10][i] - 33;
+        }
+    }
+    if (mc) {
+        d = bam_get_aux(b);
+        memcpy(d, "MCZ", 3);
+        memcpy(d + 3, mc, mc_len);
+        d[3 + mc_len] = 0;
+    }
+    memcpy(b->data + b->l_data, line, len + 1);
+    return 0;
+}
+
+/* Parse the line kept by sam_text_read() with the light record into a full one. */
+static int sam_text_full(const bam1_t *light, bam_hdr_t *hdr, bam1_t *b)
+{
+    kstring_t ks;
+
+    ks.s = (char *)light->data + light->l_data;
+    ks.l = strlen(ks.s);
+    ks.m = ks.l + 1;
+    return sam_parse1(&ks, hdr, b);
+}
+
+/* Read the line at a given offset and parse it in full. Offsets must
+   not go back within what is already read. */
+static int sam_text_read_at(sam_text_t *t, bam_hdr_t *hdr, int64_t offset, bam1_t *b)
+{
+    uint32_t tabs[SAM_MAX_TABS];
+    kstring_t ks;
+    ssize_t len;
+    char *line;
+    int n_tabs;
+
+    if (offset >= t->buf_off + (int64_t)t->pos && offset < t->buf_off + (int64_t)t->len) {
+        t->pos = offset - t->buf_off;
+    } else if (offset != t->buf_off + (int64_t)t->pos) {
+        if (hseek(t->fp, offset, SEEK_SET) < 0)
+            return -2;
+        t->buf_off = offset;
+        t->len = t->pos = 0;
+        t->eof = false;
+    }
+    if ((len = sam_text_line(t, &line, tabs, &n_tabs)) < 0)
+        return len == -1 ? -2 : len;
+    ks.s = line;
+    ks.l = len;
+    ks.m = len + 1;
+    return sam_parse1(&ks, hdr, b);
+}
+
+/* A large read of an input done ahead of time. The blocks starting in its
+   first PREFETCH_CHUNK bytes are whole in it. */
+typedef struct {
+    uint8_t *buf;
+    int fd;
+    uint64_t off;
+    size_t want;
+    ssize_t got;        // bytes read, or -errno
+    bool done;
+    int pending;        // blocks of it still being inflated
+    struct iovec iov;
+} prefetch_chunk_t;
+
+/* Keeps a number of large reads of an input in flight ahead of the blocks
+   being inflated, with io_uring where the kernel has it and with reads on
+   a few threads of its own otherwise. */
+typedef struct {
+    int fd;
+    uint64_t size;
+    int depth;
+    std::vector<prefetch_chunk_t *> chunks, spare;
+    std::deque<prefetch_chunk_t *> active; // being read or in use, in file order
+    uint64_t next_read;
+    int submitted;
+    int ring_fd;
+    void *sq_ptr, *cq_ptr, *sqe_ptr;
+    size_t sq_len, cq_len, sqe_len;
+#ifdef HAVE_IO_URING
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+#endif
+    hts_tpool *pool;    // the threads doing the reads without io_uring
+    hts_tpool_process *q;
+    // what the reads were like
+    uint64_t reads, depth_sum, max_depth, stalls, stall_ns;
+} prefetch_t;
+
+#ifdef HAVE_IO_URING
+/* Set up an io_uring the plain way, without liburing. */
+static int uring_init(prefetch_t *pf, unsigned entries)
+{
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    if ((pf->ring_fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        return -1;
+    pf->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    pf->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    pf->sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    pf->sq_ptr = mmap(NULL, pf->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      pf->ring_fd, IORING_OFF_SQ_RING);
+    pf->cq_ptr = mmap(NULL, pf->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      pf->ring_fd, IORING_OFF_CQ_RING);
+    pf->sqe_ptr = mmap(NULL, pf->sqe_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       pf->ring_fd, IORING_OFF_SQES);
+    if (pf->sq_ptr == MAP_FAILED || pf->cq_ptr == MAP_FAILED || pf->sqe_ptr == MAP_FAILED)
+        return -1;
+
+    sq = (uint8_t *)pf->sq_ptr;
+    cq = (uint8_t *)pf->cq_ptr;
+    pf->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    pf->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    pf->sq_array = (unsigned *)(sq + p.sq_off.array);
+    pf->cq_head = (unsigned *)(cq + p.cq_off.head);
+    pf->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    pf->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    pf->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    pf->sqes = (struct io_uring_sqe *)pf->sqe_ptr;
+    return 0;
+}
+
+static int uring_submit(prefetch_t *pf, prefetch_chunk_t *c)
+{
+    unsigned tail = *pf->sq_tail, i = tail & *pf->sq_mask;
+    struct io_uring_sqe *sqe = &pf->sqes[i];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = pf->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&c->iov;
+    sqe->len = 1;
+    sqe->off = c->off;
+    sqe->user_data = (uint64_t)(uintptr_t)c;
+    pf->sq_array[i] = i;
+    __atomic_store_n(pf->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return syscall(__NR_io_uring_enter, pf->ring_fd, 1, 0, 0, NULL, 0) == 1 ? 0 : -1;
+}
+
+/* Wait for at least one read to complete. */
+static int uring_reap(prefetch_t *pf)
+{
+    unsigned head = *pf->cq_head;
+
+    while (head == __atomic_load_n(pf->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (syscall(__NR_io_uring_enter, pf->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                errno != EINTR)
+            return -1;
+    }
+    for (; head != __atomic_load_n(pf->cq_tail, __ATOMIC_ACQUIRE); head++) {
+        struct io_uring_cqe *cqe = &pf->cqes[head & *pf->cq_mask];
+        prefetch_chunk_t *c = (prefetch_chunk_t *)(uintptr_t)cqe->user_data;
+        c->got = cqe->res;
+        c->done = true;
+        pf->submitted--;
+    }
+    __atomic_store_n(pf->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+#endif
+
+/* Read what is left of a chunk after the first done bytes. */
+static ssize_t chunk_read(prefetch_chunk_t *c, size_t done)
+{
+    ssize_t n = 0;
+
+    while (done < c->want && (n = pread(c->fd, c->buf + done, c->want - done, c->off + done)) > 0)
+        done += n;
+    return n < 0 ? -errno : (ssize_t)done;
+}
+
+static void *prefetch_job(void *arg)
+{
+    prefetch_chunk_t *c = (prefetch_chunk_t *)arg;
+    uint64_t t = trace_begin();
+
+    c->got = chunk_read(c, 0);
+    trace_end("read", t);
+    return c;
+}
+
+/* Wait for a read to complete, from whichever source is doing it. */
+static int prefetch_reap(prefetch_t *pf)
+{
+    hts_tpool_result *r;
+
+#ifdef HAVE_IO_URING
+    if (pf->ring_fd >= 0)
+        return uring_reap(pf);
+#endif
+    if (!(r = hts_tpool_next_result_wait(pf->q)))
+        return -1;
+    ((prefetch_chunk_t *)hts_tpool_result_data(r))->done = true;
+    hts_tpool_delete_result(r, 0);
+    pf->submitted--;
+    return 0;
+}
+
+/* Keep up to depth reads in flight. */
+static int prefetch_issue(prefetch_t *pf)
+{
+    prefetch_chunk_t *c;
+    int ret;
+
+    while (pf->submitted < pf->depth && !pf->spare.empty() && pf->next_read < pf->size) {
+        c = pf->spare.back();
+        pf->spare.pop_back();
+        c->off = pf->next_read;
+        c->want = std::min((uint64_t)PREFETCH_CHUNK + BGZF_MAX_BLOCK_SIZE, pf->size - c->off);
+        c->got = 0;
+        c->done = false;
+        c->pending = 0;
+        c->iov.iov_base = c->buf;
+        c->iov.iov_len = c->want;
+#ifdef HAVE_IO_URING
+        if (pf->ring_fd >= 0)
+            ret = uring_submit(pf, c);
+        else
+#endif
+            ret = hts_tpool_dispatch(pf->pool, pf->q, prefetch_job, c);
+        if (ret < 0) {
+            pf->spare.push_back(c);
+            return -1;
+        }
+        pf->active.push_back(c);
+        pf->next_read += PREFETCH_CHUNK;
+        pf->submitted++;
+        pf->reads++;
+        pf->depth_sum += pf->submitted;
+        pf->max_depth = std::max(pf->max_depth, (uint64_t)pf->submitted);
+    }
+    return 0;
+}
+
+/* Find len bytes at off among the reads, waiting for them if need be. Reads
+   that are done with are reused, and reading starts over after a seek. */
+static const uint8_t *prefetch_get(prefetch_t *pf, uint64_t off, size_t len, prefetch_chunk_t **chunk)
+{
+    prefetch_chunk_t *c = NULL;
+    uint64_t start;
+
+    while (!pf->active.empty()) {
+        c = pf->active.front();
+        if (!c->done || c->pending || c->off + PREFETCH_CHUNK > off)
+            break;
+        pf->active.pop_front();
+        pf->spare.push_back(c);
+    }
+    c = NULL;
+    for (size_t i = 0; i < pf->active.size(); i++) {
+        if (pf->active[i]->off <= off && off < pf->active[i]->off + PREFETCH_CHUNK) {
+            c = pf->active[i];
+            break;
+        }
+    }
+    if (!c && off != pf->next_read) {
+        // a seek away from what is being read, finish that and start over
+        while (pf->submitted) {
+            if (prefetch_reap(pf) < 0)
+                return NULL;
+        }
+        while (!pf->active.empty()) {
+            pf->spare.push_back(pf->active.front());
+            pf->active.pop_front();
+        }
+        pf->next_read = off;
+    }
+    if (prefetch_issue(pf) < 0)
+        return NULL;
+    if (!c)
+        c = pf->active.front();
+
+    if (!c->done) {
+        start = now_ns();
+        pf->stalls++;
+        while (!c->done) {
+            if (prefetch_reap(pf) < 0)
+                return NULL;
+        }
+        pf->stall_ns += now_ns() - start;
+    }
+    if (c->got >= 0 && (size_t)c->got < c->want)
+        c->got = chunk_read(c, c->got);
+    if (c->got < 0 || off + len > c->off + c->got)
+        return NULL;
+    *chunk = c;
+    return c->buf + (off - c->off);
+}
+
+static void prefetch_destroy(prefetch_t *pf)
+{
+    if (!pf)
+        return;
+    while (pf->submitted && prefetch_reap(pf) == 0)
+        ;
+    if (pf->reads) {
+        error("Prefetch (%s): %" PRIu64 " reads, mean depth %.1f, max depth %" PRIu64
+              ", %" PRIu64 " stalls for %.1f ms", pf->ring_fd >= 0 ? "io_uring" : "threads",
+              pf->reads, (double)pf->depth_sum / pf->reads, pf->max_depth,
+              pf->stalls, pf->stall_ns / 1e6);
+    }
+    if (pf->sq_ptr && pf->sq_ptr != MAP_FAILED) munmap(pf->sq_ptr, pf->sq_len);
+    if (pf->cq_ptr && pf->cq_ptr != MAP_FAILED) munmap(pf->cq_ptr, pf->cq_len);
+    if (pf->sqe_ptr && pf->sqe_ptr != MAP_FAILED) munmap(pf->sqe_ptr, pf->sqe_len);
+    if (pf->ring_fd >= 0)
+        close(pf->ring_fd);
+    if (pf->q)
+        hts_tpool_process_destroy(pf->q);
+    if (pf->pool)
+        hts_tpool_destroy(pf->pool);
+    for (size_t i = 0; i < pf->chunks.size(); i++) {
+        free(pf->chunks[i]->buf);
+        delete pf->chunks[i];
+    }
+    delete pf;
+}
+
+static prefetch_t *prefetch_init(int fd, uint64_t size, int depth)
+{
+    prefetch_t *pf = new prefetch_t();
+
+    pf->fd = fd;
+    pf->size = size;
+    pf->depth = depth;
+    pf->ring_fd = -1;
+    // two more than in flight, for those whose blocks are still being inflated
+    for (int i = 0; i < depth + 2; i++) {
+        prefetch_chunk_t *c = new prefetch_chunk_t();
+        c->fd = fd;
+        if (!(c->buf = (uint8_t *)malloc(PREFETCH_CHUNK + BGZF_MAX_BLOCK_SIZE))) {
+            delete c;
+            prefetch_destroy(pf);
+            return NULL;
+        }
+        pf->chunks.push_back(c);
+        pf->spare.push_back(c);
+    }
+#ifdef HAVE_IO_URING
+    if (uring_init(pf, depth) == 0)
+        return pf;
+    if (pf->ring_fd >= 0)
+        close(pf->ring_fd);
+    pf->ring_fd = -1;
+#endif
+    if (!(pf->pool = hts_tpool_init(std::min(depth, PREFETCH_THREADS))) ||
+            !(pf->q = hts_tpool_process_init(pf->pool, depth + 2, 0))) {
+        prefetch_destroy(pf);
+        return NULL;
+    }
+    return pf;
+}
+
+/* A bgzf block of a bam input, inflated by the thread pool */
+typedef struct {
+    const uint8_t *src; // the compressed block, in the mapping or a prefetched read
+    prefetch_chunk_t *chunk;
+    uint64_t c_off;
+    int c_len;
+    int u_len;          // -1 if it is corrupt
+    uint8_t data[BGZF_MAX_BLOCK_SIZE];
+} reader_block_t;
+
+/* A bam input read by doopa rather than through hFILE buffered reads.
+   Compressed blocks come straight from a read-only mapping of the file,
+   or from large reads done ahead of time. They are inflated on the thread
+   pool and come back in file order. */
+typedef struct {
+    int fd;
+    uint8_t *map;
+    prefetch_t *pf;
+    size_t size;
+    hts_tpool *pool;
+    hts_tpool_process *q;
+    uint64_t next_off;  // next block to hand to the pool
+    int in_flight;
+    std::vector<reader_block_t *> blocks, spare;
+    reader_block_t *cur;
+    int pos;            // offset into cur
+    size_t advised;     // the kernel was told we need the mapping up to here
+} bgzf_reader_t;
+
+static inline uint32_t le_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint16_t le_u16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static void *reader_inflate(void *arg)
+{
+    reader_block_t *blk = (reader_block_t *)arg;
+    uint64_t t = trace_begin();
+    int xlen = le_u16(blk->src + 10);
+    const uint8_t *trailer = blk->src + blk->c_len - 8;
+    z_stream zs;
+
+    blk->u_len = -1;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -15) != Z_OK)
+        return blk;
+    zs.next_in = (Bytef *)blk->src + 12 + xlen;
+    zs.avail_in = blk->c_len - 12 - xlen - 8;
+    zs.next_out = blk->data;
+    zs.avail_out = BGZF_MAX_BLOCK_SIZE;
+    if (inflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out == le_u32(trailer + 4) &&
+            crc32(crc32(0L, Z_NULL, 0), blk->data, zs.total_out) == le_u32(trailer))
+        blk->u_len = zs.total_out;
+    inflateEnd(&zs);
+    trace_end("inflate", t);
+    return blk;
+}
+
+/* Where len bytes of the file at off are, or NULL if they are not there. */
+static inline const uint8_t *reader_src(bgzf_reader_t *m, uint64_t off, size_t len,
+                                        prefetch_chunk_t **chunk)
+{
+    *chunk = NULL;
+    if (m->pf)
+        return prefetch_get(m->pf, off, len, chunk);
+    return off + len <= m->size ? m->map + off : NULL;
+}
+
+/* Find the bgzf block at off. Returns its size, or -1 if there is none. */
+static int reader_block(bgzf_reader_t *m, uint64_t off, const uint8_t **src, prefetch_chunk_t **chunk)
+{
+    const uint8_t *h, *x;
+    int xlen, len;
+
+    if (!(h = reader_src(m, off, 18, chunk)) ||
+            h[0] != 31 || h[1] != 139 || h[2] != 8 || !(h[3] & 4))
+        return -1;
+    xlen = le_u16(h + 10);
+    for (x = h + 12; x + 4 <= h + 12 + xlen; x += 4 + le_u16(x + 2)) {
+        if (x[0] == 'B' && x[1] == 'C' && le_u16(x + 2) == 2) {
+            len = le_u16(x + 4) + 1;
+            if (len < 12 + xlen + 8 || !(*src = reader_src(m, off, len, chunk)))
+                return -1;
+            return len;
+        }
+    }
+    return -1;
+}
+
+/* Hand blocks to the pool until INFLATE_QUEUE are on their way. A mapping
+   is read ahead of them by the kernel. */
+static int reader_fill(bgzf_reader_t *m)
+{
+    prefetch_chunk_t *chunk;
+    const uint8_t *src;
+    reader_block_t *blk;
+    int len;
+
+    while (m->in_flight < INFLATE_QUEUE && m->next_off < m->size) {
+        if ((len = reader_block(m, m->next_off, &src, &chunk)) < 0)
+            return -1;
+        if (m->map && m->next_off + MAP_READAHEAD / 2 > m->advised && m->advised < m->size) {
+            size_t page = sysconf(_SC_PAGESIZE), start = m->advised & ~(page - 1);
+            size_t end = std::min(m->advised + MAP_READAHEAD, m->size);
+            madvise(m->map + start, end - start, MADV_WILLNEED);
+            m->advised = end;
+        }
+        blk = m->spare.back();
+        m->spare.pop_back();
+        blk->src = src;
+        blk->chunk = chunk;
+        blk->c_off = m->next_off;
+        blk->c_len = len;
+        if (chunk)
+            chunk->pending++;
+        if (hts_tpool_dispatch(m->pool, m->q, reader_inflate, blk) < 0)
+            return -1;
+        m->in_flight++;
+        m->next_off += len;
+    }
+    return 0;
+}
+
+/* Take the next inflated block off the queue. */
+static reader_block_t *reader_take(bgzf_reader_t *m)
+{
+    hts_tpool_result *r;
+    reader_block_t *blk;
+
+    if (!(r = hts_tpool_next_result_wait(m->q)))
+        return NULL;
+    blk = (reader_block_t *)hts_tpool_result_data(r);
+    hts_tpool_delete_result(r, 0);
+    m->in_flight--;
+    if (blk->chunk)
+        blk->chunk->pending--;
+    return blk;
+}
+
+/* Move on to the next inflated block. Returns 0, -1 at the end and -2 on error. */
+static int reader_next_block(bgzf_reader_t *m)
+{
+    if (m->cur)
+        m->spare.push_back(m->cur);
+    m->cur = NULL;
+    m->pos = 0;
+    if (reader_fill(m) < 0)
+        return -2;
+    if (!m->in_flight)
+        return -1;
+    if (!(m->cur = reader_take(m)))
+        return -2;
+    return m->cur->u_len < 0 ? -2 : 0;
+}
+
+/* Make sure there is data left in the current block. */
+static inline int reader_ensure(bgzf_reader_t *m)
+{
+    int ret;
+
+    while (!m->cur || m->pos == m->cur->u_len) {
+        if ((ret = reader_next_block(m)) < 0)
+            return ret;
+    }
+    return 0;
+}
+
+/* The virtual offset of the next byte, the same as bgzf_tell() gives. */
+static uint64_t reader_tell(bgzf_reader_t *m)
+{
+    if (reader_ensure(m) < 0)
+        return (uint64_t)m->next_off << 16;
+    return (m->cur->c_off << 16) | m->pos;
+}
+
+static int reader_seek(bgzf_reader_t *m, uint64_t voffset)
+{
+    uint64_t off = voffset >> 16;
+    reader_block_t *blk;
+    int ret;
+
+    if (m->cur && m->cur->c_off == off && (int)(voffset & 0xffff) <= m->cur->u_len) {
+        m->pos = voffset & 0xffff;
+        return 0;
+    }
+    // what is already on its way is of no use
+    while (m->in_flight) {
+        if (!(blk = reader_take(m)))
+            return -1;
+        m->spare.push_back(blk);
+    }
+    m->next_off = off;
+    m->advised = off;
+    if ((ret = reader_next_block(m)) < 0)
+        return ret == -1 && !(voffset & 0xffff) ? 0 : -1;
+    if ((int)(voffset & 0xffff) > m->cur->u_len)
+        return -1;
+    m->pos = voffset & 0xffff;
+    return 0;
+}
+
+/* Copy n bytes out of the inflated blocks. Returns how many there were. */
+static ssize_t reader_read(bgzf_reader_t *m, void *dst, size_t n)
+{
+    uint8_t *d = (uint8_t *)dst;
+    size_t done = 0, k;
+    int ret;
+
+    while (done < n) {
+        if ((ret = reader_ensure(m)) < 0)
+            return ret == -1 ? (ssize_t)done : -1;
+        k = std::min(n - done, (size_t)(m->cur->u_len - m->pos));
+        memcpy(d + done, m->cur->data + m->pos, k);
+        m->pos += k;
+        done += k;
+    }
+    return done;
+}
+
+/* A cigar of more than 65535 operations is kept in a CG tag, with a
+   placeholder of kSmN in the record. Put it back in place, as
+   bam_read1() does. Returns -1 if the tag is malformed. */
+static int cigar_from_tag(bam1_t *b)
+{
+    bam1_core_t *c = &b->core;
+    uint32_t *cigar = bam_get_cigar(b);
+    uint32_t n, cg_start, cg_end;
+    size_t fake = 4 * c->n_cigar, real;
+    uint8_t *cg, *tmp;
+
+    if (!c->n_cigar || c->tid < 0 || c->pos < 0 || bam_cigar_op(cigar[0]) != BAM_CSOFT_CLIP ||
+            bam_cigar_oplen(cigar[0]) != (uint32_t)c->l_qseq)
+        return 0;
+    if (!(cg = bam_aux_get(b, "CG")) || cg[0] != 'B' || (cg[1] != 'I' && cg[1] != 'i'))
+        return 0;
+    n = le_u32(cg + 2);
+    real = 4 * (size_t)n;
+    cg_start = cg - 2 - b->data;
+    if (cg + 6 + real > b->data + b->l_data)
+        return -1;
+    cg_end = cg_start + 8 + real;
+    if (!(tmp = (uint8_t *)malloc(real)))
+        return -1;
+    memcpy(tmp, cg + 6, real);
+
+    // drop the tag, then swap the placeholder for the real cigar; this
+    // leaves the record shorter, so it fits where it is
+    memmove(b->data + cg_start, b->data + cg_end, b->l_data - cg_end);
+    b->l_data -= 8 + real;
+    memmove(b->data + c->l_qname + real, b->data + c->l_qname + fake, b->l_data - c->l_qname - fake);
+    memcpy(b->data + c->l_qname, tmp, real);
+    b->l_data += (int)real - (int)fake;
+    c->n_cigar = n;
+    free(tmp);
+    return 0;
+}
+
+/* Read the next bam record, like bam_read1(). Returns -1 at the end and
+   < -1 on error. */
+static int reader_read_bam(bgzf_reader_t *m, bam1_t *b)
+{
+    bam1_core_t *c = &b->core;
+    uint8_t x[32];
+    uint32_t block_len, extranul, l_qname, need;
+    ssize_t n;
+
+    if ((n = reader_read(m, x, 4)) != 4)
+        return n == 0 ? -1 : -2;
+    block_len = le_u32(x);
+    if (block_len < 32 || reader_read(m, x, 32) != 32)
+        return -2;
+    c->tid = (int32_t)le_u32(x);
+    c->pos = (int32_t)le_u32(x + 4);
+    l_qname = x[8];
+    c->qual = x[9];
+    c->bin = le_u16(x + 10);
+    c->n_cigar = le_u16(x + 12);
+    c->flag = le_u16(x + 14);
+    c->l_qseq = (int32_t)le_u32(x + 16);
+    c->mtid = (int32_t)le_u32(x + 20);
+    c->mpos = (int32_t)le_u32(x + 24);
+    c->isize = (int32_t)le_u32(x + 28);
+    // the parts must fit in the record, as bam_read1() checks
+    if (!l_qname || c->l_qseq < 0 ||
+            (uint64_t)l_qname + 4ULL * c->n_cigar + ((uint64_t)c->l_qseq + 1) / 2 + c->l_qseq > block_len - 32)
+        return -4;
+
+    // pad the name so the cigar is aligned, as htslib does
+    extranul = l_qname % 4 ? 4 - l_qname % 4 : 0;
+    need = block_len - 32 + extranul;
+    if (need > b->m_data) {
+        uint8_t *d = (uint8_t *)realloc(b->data, need);
+        if (!d)
+            return -4;
+        b->data = d;
+        b->m_data = need;
+    }
+    if (reader_read(m, b->data, l_qname) != l_qname)
+        return -3;
+    memset(b->data + l_qname, 0, extranul);
+    if (reader_read(m, b->data + l_qname + extranul, block_len - 32 - l_qname) != block_len - 32 - l_qname)
+        return -3;
+    c->l_qname = l_qname + extranul;
+    c->l_extranul = extranul;
+    b->l_data = need;
+    return cigar_from_tag(b) < 0 ? -4 : 0;
+}
+
+static void reader_close(bgzf_reader_t *m)
+{
+    if (!m)
+        return;
+    if (m->q) {
+        hts_tpool_process_flush(m->q);
+        hts_tpool_process_destroy(m->q);
+    }
+    for (size_t i = 0; i < m->blocks.size(); i++) {
+        delete m->blocks[i];
+    }
+    prefetch_destroy(m->pf);
+    if (m->map)
+        munmap(m->map, m->size);
+    if (m->fd >= 0)
+        close(m->fd);
+    delete m;
+}
+
+/* Open a bam file to be read by doopa, starting at voffset. Blocks come
+   from a mapping of the file, or with prefetch reads that many reads
+   ahead. Returns NULL if that cannot be done, it is then read the usual way. */
+static bgzf_reader_t *reader_open(const char *filename, hts_tpool *pool, uint64_t voffset,
+                                  int prefetch)
+{
+    bgzf_reader_t *m = new bgzf_reader_t();
+    struct stat sb;
+    void *map;
+
+    m->fd = open(filename, O_RDONLY);
+    if (m->fd < 0 || fstat(m->fd, &sb) < 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0)
+        goto fail;
+    m->size = sb.st_size;
+    if (prefetch) {
+        if (!(m->pf = prefetch_init(m->fd, m->size, prefetch)))
+            goto fail;
+    } else {
+        map = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, m->fd, 0);
+        if (map == MAP_FAILED)
+            goto fail;
+        m->map = (uint8_t *)map;
+        madvise(m->map, m->size, MADV_SEQUENTIAL);
+    }
+
+    m->pool = pool;
+    if (!(m->q = hts_tpool_process_init(pool, INFLATE_QUEUE, 0)))
+        goto fail;
+    for (int i = 0; i <= INFLATE_QUEUE; i++) {
+        m->blocks.push_back(new reader_block_t);
+        m->spare.push_back(m->blocks.back());
+    }
+    if (reader_seek(m, voffset) < 0)
+        goto fail;
+    return m;
+
+fail:
+    reader_close(m);
+    return NULL;
+}
+
+/* One coordinate sorted, indexed input and the read it is at. Reads in a
+   cram file have no virtual offset, they are numbered in file order instead.
+   Reads in sam text are identified by the file offset of their line. */
+typedef struct {
+    const char *filename;
+    samFile *fp;
+    hts_idx_t *idx;
+    hts_itr_t *iter;
+    bam_hdr_t *hdr;
+    bam1_t *b;
+    bool cram;
+    sam_text_t *text;
+    bgzf_reader_t *reader;
+    uint64_t voffset;
+    uint64_t n_read;
+    uint64_t unplaced_off;
+    uint64_t n_unplaced;
+    const uint64_t *survivors;
+    size_t n_survivors;
+    size_t next;
+    bool ended;         // pass 1 has read all its placed reads
+} input_t;
+
+/* Open an input for pass 1. */
+static int input_open(input_t *in, const doopa_opts_t *opts, htsThreadPool *p)
+{
+    if (!(in->fp = sam_open(in->filename, "r")))
+        return -1;
+    in->cram = in->fp->format.format == cram;
+    if (is_sam_text(in->fp) && !(in->text = sam_text_init(in->fp->fp.hfile)))
+        return -1;
+    // a bam input doopa reads itself gets the pool only if that can't be done
+    if (!((opts->mmap || opts->prefetch) && in->fp->format.format == bam))
+        hts_set_opt(in->fp, HTS_OPT_THREAD_POOL, p);
+    cram_setup(in->fp, opts, true);
+    return 0;
+}
+
+/* Read the header of an input. With --mmap or --prefetch a bam input is
+   then read by doopa rather than through htslib. */
+static bam_hdr_t *input_read_header(input_t *in, const doopa_opts_t *opts, htsThreadPool *p)
+{
+    if (in->text)
+        return sam_text_header(in->text);
+    if (!(in->hdr = sam_hdr_read(in->fp)))
+        return NULL;
+    if ((opts->mmap || opts->prefetch) && in->fp->format.format == bam &&
+            !(in->reader = reader_open(in->filename, p->pool, bgzf_tell(in->fp->fp.bgzf), opts->prefetch))) {
+        error("Couldn't %s \"%s\", reading it instead", opts->mmap ? "map" : "prefetch", in->filename);
+        hts_set_opt(in->fp, HTS_OPT_THREAD_POOL, p);
+    }
+    return in->hdr;
+}
+
+/* Read the next record of an input in file order, and where it starts. */
+static int input_read(input_t *in, uint64_t *voffset)
+{
+    if (in->text) {
+        int ret = sam_text_read(in->text, in->hdr, in->b);
+        *voffset = in->text->line_off;
+        return ret;
+    }
+    if (in->reader) {
+        *voffset = reader_tell(in->reader);
+        return reader_read_bam(in->reader, in->b);
+    }
+    *voffset = in->cram ? in->n_read++ : bgzf_tell(in->fp->fp.bgzf);
+    return sam_read1(in->fp, in->hdr, in->b);
+}
+
+/* Open a cram input again from the start for pass 2, decoding reads in full. */
+static int input_reopen(input_t *in, const doopa_opts_t *opts, htsThreadPool *p)
+{
+    samFile *fp = sam_open(in->filename, "r");
+    bam_hdr_t *hdr;
+
+    if (!fp)
+        return -1;
+    hts_set_opt(fp, HTS_OPT_THREAD_POOL, p);
+    cram_setup(fp, opts, false);
+    if (!(hdr = sam_hdr_read(fp))) {
+        sam_close(fp);
+        return -1;
+    }
+    sam_close(in->fp);
+    bam_hdr_destroy(in->hdr);
+    in->fp = fp;
+    in->hdr = hdr;
+    in->n_read = 0;
+    return 0;
+}
+
+/* Orders inputs by the position of their current read, for a max-heap
+   that has to give the leftmost read first. */
+struct input_after {
+    const std::vector<input_t> *in;
+
+    bool operator()(int i, int j) const {
+        const bam1_core_t *a = &(*in)[i].b->core, *b = &(*in)[j].b->core;
+
+        if (a->tid != b->tid)
+            return (uint32_t)a->tid > (uint32_t)b->tid;
+        if (a->pos != b->pos)
+            return a->pos > b->pos;
+        return i > j;
+    }
+};
+
+typedef std::priority_queue<int, std::vector<int>, input_after> input_heap_t;
+
+/* Read the next placed read of an input. Returns 1 if there is one,
+   0 at the unplaced reads or the end of the file and -1 on error. */
+static int input_next_placed(input_t *in)
+{
+    int ret;
+
+    if (in->reader) {
+        // the iterator starts at the first read, the mapping is already there
+        in->voffset = reader_tell(in->reader);
+        ret = reader_read_bam(in->reader, in->b);
+    } else {
+        in->voffset = in->cram ? in->n_read++ : bgzf_tell(in->fp->fp.bgzf);
+        ret = sam_itr_next(in->fp, in->iter, in->b);
+    }
+    if (ret < 0)
+        return ret < -1 ? -1 : 0;
+    if (in->b->core.tid < 0) {
+        if (in->cram) {
+            // a cram index does not count them, but they are cheap to read
+            in->n_unplaced = 1;
+            while ((ret = sam_itr_next(in->fp, in->iter, in->b)) >= 0)
+                in->n_unplaced++;
+            if (ret < -1)
+                return -1;
+        } else if (!in->unplaced_off) {
+            in->unplaced_off = in->voffset;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/* Go back to where a saved pass 1 stopped reading an input. */
+static int input_resume(input_t *in)
+{
+    uint64_t n = in->voffset;
+
+    if (in->reader)
+        return reader_seek(in->reader, in->voffset);
+    if (in->cram) {
+        // cram records have no address, skip as many as had been read
+        for (in->n_read = 0; in->n_read < n; in->n_read++) {
+            if (sam_itr_next(in->fp, in->iter, in->b) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    // the iterator seeks there before its first read
+    in->iter->curr_off = in->voffset;
+    return 0;
+}
+
+/* Read the next survivor of an input. Runs of blocks holding no survivors
+   are skipped with a seek, cram files are read through. Returns 1 if there
+   is one, 0 when all are read and -1 on error. */
+static int input_next_survivor(input_t *in)
+{
+    BGZF *fp = in->fp->fp.bgzf;
+    uint64_t pos, target;
+
+    if (in->next == in->n_survivors)
+        return 0;
+    target = READ_VOFFSET(in->survivors[in->next]);
+    if (in->text) {
+        if (sam_text_read_at(in->text, in->hdr, target, in->b) < 0)
+            return -1;
+        in->next++;
+        return 1;
+    }
+    if (in->reader) {
+        // skipped blocks are not even inflated
+        for (;;) {
+            pos = reader_tell(in->reader);
+            if (pos > target || (target >> 16) - (pos >> 16) >= SEEK_GAP) {
+                if (reader_seek(in->reader, target) < 0)
+                    return -1;
+                pos = target;
+            }
+            if (reader_read_bam(in->reader, in->b) < 0)
+                return -1;
+            if (pos == target) {
+                in->next++;
+                return 1;
+            }
+        }
+    }
+    for (;;) {
+        if (in->cram) {
+            pos = in->n_read;
+        } else {
+            pos = bgzf_tell(fp);
+            if (pos > target || (target >> 16) - (pos >> 16) >= SEEK_GAP) {
+                if (bgzf_seek(fp, target, SEEK_SET) < 0)
+                    return -1;
+                pos = target;
+            }
+        }
+        if (sam_read1(in->fp, in->hdr, in->b) < 0)
+            return -1;
+        in->n_read++;
+        if (pos == target) {
+            in->next++;
+            return 1;
+        }
+    }
+}
+
+/* A sidecar of a bam input records which of its reads survived, so it can
+   be read deduplicated without writing a copy of it. It is the header below
+   followed by the survivors' virtual offsets, sorted, in host byte order,
+   and is mapped straight into memory by doopa view. The byte after DOOPA
+   is its version. */
+#define SIDECAR_MAGIC "DOOPA\2\0\0"
+
+typedef struct {
+    char magic[8];
+    uint64_t bam_size;      // size of the input it was made from
+    uint64_t bam_mtime;     // and when that was last changed, in ns
+    uint64_t n_survivors;
+    uint64_t n_unplaced;
+    uint64_t unplaced_off;  // where the unplaced reads start, 0 if not known
+} sidecar_hdr_t;
+
+/* The sidecar of a bam file, mapped into memory. */
+typedef struct {
+    void *map;
+    size_t size;
+    const sidecar_hdr_t *hdr;
+    const uint64_t *survivors;
+} sidecar_t;
+
+/* When a file was last changed, in ns. */
+static uint64_t mtime_ns(const struct stat *sb)
+{
+    return (uint64_t)sb->st_mtim.tv_sec * 1000000000 + sb->st_mtim.tv_nsec;
+}
+
+/* Write the sidecar of an input next to it, as FILE.doopa. */
+static int write_sidecar(const input_t *in, const uint64_t *ids, size_t n)
+{
+    std::string path = std::string(in->filename) + ".doopa";
+    struct stat sb;
+    sidecar_hdr_t h;
+    uint64_t voffset;
+    FILE *fp;
+    bool ok;
+
+    if (stat(in->filename, &sb) < 0)
+        return -1;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SIDECAR_MAGIC, sizeof(h.magic));
+    h.bam_size = sb.st_size;
+    h.bam_mtime = mtime_ns(&sb);
+    h.n_survivors = n;
+    h.n_unplaced = hts_idx_get_n_no_coor(in->idx);
+    h.unplaced_off = h.n_unplaced ? in->unplaced_off : 0;
+
+    if (!(fp = fopen(path.c_str(), "wb")))
+        return -1;
+    ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    for (size_t i = 0; ok && i < n; i++) {
+        voffset = READ_VOFFSET(ids[i]);
+        ok = fwrite(&voffset, sizeof(voffset), 1, fp) == 1;
+    }
+    return fclose(fp) == 0 && ok ? 0 : -1;
+}
+
+static void sidecar_unmap(sidecar_t *sc)
+{
+    if (sc->map)
+        munmap(sc->map, sc->size);
+    sc->map = NULL;
+}
+
+/* Map the sidecar of filename, checking it is one and is not out of date. */
+static int sidecar_map(sidecar_t *sc, const char *filename)
+{
+    std::string path = std::string(filename) + ".doopa";
+    struct stat sb;
+    int fd;
+
+    sc->map = NULL;
+    if ((fd = open(path.c_str(), O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+        error("Couldn't open \"%s\"", path.c_str());
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    sc->size = sb.st_size;
+    if (sc->size >= sizeof(sidecar_hdr_t))
+        sc->map = mmap(NULL, sc->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (sc->map == MAP_FAILED)
+        sc->map = NULL;
+    sc->hdr = (const sidecar_hdr_t *)sc->map;
+    sc->survivors = (const uint64_t *)(sc->hdr + 1);
+    if (sc->map && !memcmp(sc->hdr->magic, SIDECAR_MAGIC, 5) &&
+            memcmp(sc->hdr->magic, SIDECAR_MAGIC, sizeof(sc->hdr->magic))) {
+        errno = 0; error("\"%s\" was made by another version of doopa, make it again", path.c_str());
+        sidecar_unmap(sc);
+        return -1;
+    }
+    if (!sc->map || memcmp(sc->hdr->magic, SIDECAR_MAGIC, sizeof(sc->hdr->magic)) ||
+            sc->size != sizeof(sidecar_hdr_t) + sc->hdr->n_survivors * sizeof(uint64_t)) {
+        errno = 0; error("\"%s\" is not a doopa sidecar", path.c_str());
+        sidecar_unmap(sc);
+        return -1;
+    }
+    if (stat(filename, &sb) < 0 || (uint64_t)sb.st_size != sc->hdr->bam_size ||
+            mtime_ns(&sb) != sc->hdr->bam_mtime) {
+        errno = 0; error("\"%s\" is out of date, \"%s\" has changed since", path.c_str(), filename);
+        sidecar_unmap(sc);
+        return -1;
+    }
+    madvise(sc->map, sc->size, MADV_WILLNEED);
+    return 0;
+}
+
+/* The state of pass 1, saved to a file so a run can go on from it: the
+   winner table, the reads waiting for their mate, the statistics and how
+   far each input has been read. It is the header below followed by
+   arrays of the structs after it in that order, in host byte order, and
+   is mapped into memory to be loaded. States of finished passes over
+   different inputs can be merged with doopa merge-state. The byte after
+   DOOPAS is its version. */
+#define STATE_MAGIC "DOOPAS\2\0"
+// An input pass 1 has read to the end
+#define STATE_ENDED UINT64_MAX
+// Room for the name of an input, without its directory
+#define STATE_NAME_LEN 224
+
+typedef struct {
+    char magic[8];
+    uint32_t n_inputs;
+    uint32_t done;          // pass 1 is over
+    uint64_t n_keys, n_pending, n_order, n_fragments;
+    uint64_t total_reads, paired_reads, mapped_reads;
+    uint64_t bases_above_q30, total_bases, duplicate_reads;
+    uint64_t mates_found, mates_guessed;
+} state_hdr_t;
+
+typedef struct {
+    char name[STATE_NAME_LEN];
+    uint64_t size;          // of the input, to check it is the same one
+    uint64_t mtime;         // when it was last changed, in ns
+    uint64_t voffset;       // the read pass 1 goes on with, or STATE_ENDED
+    uint64_t n_read;
+    uint64_t n_unplaced;
+} state_input_t;
+
+typedef struct {
+    chrposlen_t key;
+    uint64_t id;
+    uint64_t qualsum;
+} state_key_t;
+
+typedef struct {
+    uint64_t hash;
+    pending_mate_t mate;
+} state_mate_t;
+
+/* A state file mapped into memory. */
+typedef struct {
+    void *map;
+    size_t size;
+    const state_hdr_t *h;
+    const state_input_t *inputs;
+    const state_key_t *keys;
+    const state_mate_t *mates;
+    const uint64_t *order;
+    const uint64_t *fragments;  // pairs of bin and count
+} state_map_t;
+
+static void state_unmap(state_map_t *sm)
+{
+    if (sm->map)
+        munmap(sm->map, sm->size);
+    sm->map = NULL;
+}
+
+static int state_map(state_map_t *sm, const char *path)
+{
+    const state_hdr_t *h;
+    struct stat sb;
+    uint64_t need;
+    void *map = MAP_FAILED;
+    int fd;
+
+    sm->map = NULL;
+    if ((fd = open(path, O_RDONLY)) >= 0 && fstat(fd, &sb) == 0 && (size_t)sb.st_size >= sizeof(*h))
+        map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd >= 0)
+        close(fd);
+    if (map == MAP_FAILED) {
+        error("Couldn't read \"%s\"", path);
+        return -1;
+    }
+    sm->map = map;
+    sm->size = sb.st_size;
+    h = sm->h = (const state_hdr_t *)map;
+    if (!memcmp(h->magic, STATE_MAGIC, 6) && memcmp(h->magic, STATE_MAGIC, sizeof(h->magic))) {
+        error("\"%s\" was saved by another version of doopa", path);
+        state_unmap(sm);
+        return -1;
+    }
+    need = sizeof(*h) + h->n_inputs * sizeof(state_input_t) + h->n_keys * sizeof(state_key_t) +
+           h->n_pending * sizeof(state_mate_t) + (h->n_order + 2 * h->n_fragments) * sizeof(uint64_t);
+    if (memcmp(h->magic, STATE_MAGIC, sizeof(h->magic)) || need != sm->size) {
+        error("\"%s\" is not a doopa state file", path);
+        state_unmap(sm);
+        return -1;
+    }
+    sm->inputs = (const state_input_t *)(h + 1);
+    sm->keys = (const state_key_t *)(sm->inputs + h->n_inputs);
+    sm->mates = (const state_mate_t *)(sm->keys + h->n_keys);
+    sm->order = (const uint64_t *)(sm->mates + h->n_pending);
+    sm->fragments = sm->order + h->n_order;
+    return 0;
+}
+
+/* Describe the inputs of a run for its state. */
+static int state_inputs(const std::vector<input_t>& inputs, std::vector<state_input_t> *si)
+{
+    struct stat sb;
+    const char *name;
+
+    si->resize(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++) {
+        const input_t *in = &inputs[i];
+        state_input_t *s = &(*si)[i];
+        if (stat(in->filename, &sb) < 0)
+            return -1;
+        memset(s->name, 0, sizeof(s->name));
+        name = strrchr(in->filename, '/');
+        snprintf(s->name, sizeof(s->name), "%s", name ? name + 1 : in->filename);
+        s->size = sb.st_size;
+        s->mtime = mtime_ns(&sb);
+        s->voffset = in->ended ? STATE_ENDED : in->voffset;
+        s->n_read = in->n_read;
+        s->n_unplaced = in->n_unplaced;
+    }
+    return 0;
+}
+
+/* Save a pass 1 state to path. It goes through a temporary file so a run
+   stopped halfway leaves the last state whole. */
+static int write_state(const char *path, const std::vector<state_input_t>& inputs, const doopa_t& mp,
+                       const mate_cache_t *mates, const dedup_stats_t *st, bool done)
+{
+    std::string tmp = std::string(path) + ".tmp";
+    state_hdr_t h;
+    state_key_t k;
+    state_mate_t m;
+    uint64_t frag[2];
+    FILE *fp;
+    bool ok;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, STATE_MAGIC, sizeof(h.magic));
+    h.n_inputs = inputs.size();
+    h.done = done;
+    h.n_keys = mp.size();
+    h.n_pending = mates->pending.size();
+    h.n_order = mates->order.size();
+    h.n_fragments = st->fragment_histogram.size();
+    h.total_reads = st->total_reads;
+    h.paired_reads = st->paired_reads;
+    h.mapped_reads = st->mapped_reads;
+    h.bases_above_q30 = st->bases_above_q30;
+    h.total_bases = st->total_bases;
+    h.duplicate_reads = st->duplicate_reads;
+    h.mates_found = mates->found;
+    h.mates_guessed = mates->guessed;
+
+    if (!(fp = fopen(tmp.c_str(), "wb")))
+        return -1;
+    ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    ok = ok && fwrite(inputs.data(), sizeof(state_input_t), inputs.size(), fp) == inputs.size();
+    for (doopa_t::const_iterator it = mp.begin(); ok && it != mp.end(); it++) {
+        k.key = it->first;
+        k.id = std::get<0>(it->second);
+        k.qualsum = std::get<1>(it->second);
+        ok = fwrite(&k, sizeof(k), 1, fp) == 1;
+    }
+    for (std::unordered_map<uint64_t, pending_mate_t>::const_iterator it = mates->pending.begin();
+            ok && it != mates->pending.end(); it++) {
+        m.hash = it->first;
+        m.mate = it->second;
+        ok = fwrite(&m, sizeof(m), 1, fp) == 1;
+    }
+    for (size_t i = 0; ok && i < mates->order.size(); i++) {
+        ok = fwrite(&mates->order[i], sizeof(uint64_t), 1, fp) == 1;
+    }
+    for (fragment_t::const_iterator it = st->fragment_histogram.begin();
+            ok && it != st->fragment_histogram.end(); it++) {
+        frag[0] = it->first;
+        frag[1] = it->second;
+        ok = fwrite(frag, sizeof(frag), 1, fp) == 1;
+    }
+    if (fclose(fp) != 0 || !ok) {
+        unlink(tmp.c_str());
+        return -1;
+    }
+    return rename(tmp.c_str(), path);
+}
+
+/* Save the pass 1 state of a run. */
+static int save_state(const char *path, const std::vector<input_t>& inputs, const doopa_t& mp,
+                      const mate_cache_t *mates, const dedup_stats_t *st, bool done)
+{
+    std::vector<state_input_t> si;
+
+    if (state_inputs(inputs, &si) < 0)
+        return -1;
+    return write_state(path, si, mp, mates, st, done);
+}
+
+/* Add the statistics saved in a state to st. */
+static void state_add_stats(const state_map_t *sm, dedup_stats_t *st, mate_cache_t *mates)
+{
+    const state_hdr_t *h = sm->h;
+
+    st->total_reads += h->total_reads;
+    st->paired_reads += h->paired_reads;
+    st->mapped_reads += h->mapped_reads;
+    st->bases_above_q30 += h->bases_above_q30;
+    st->total_bases += h->total_bases;
+    st->duplicate_reads += h->duplicate_reads;
+    for (uint64_t i = 0; i < h->n_fragments; i++) {
+        st->fragment_histogram[sm->fragments[2 * i]] += sm->fragments[2 * i + 1];
+    }
+    mates->found += h->mates_found;
+    mates->guessed += h->mates_guessed;
+}
+
+/* Load a pass 1 state saved for the same inputs. Returns whether pass 1
+   was over, or -1 on error. */
+static int read_state(const char *path, std::vector<input_t>& inputs, doopa_t *mp,
+                      mate_cache_t *mates, dedup_stats_t *st)
+{
+    state_map_t sm;
+    const state_hdr_t *h;
+    const state_input_t *si;
+    struct stat sb;
+    int ret = -1;
+
+    if (state_map(&sm, path) < 0)
+        return -1;
+    h = sm.h;
+    si = sm.inputs;
+    if (h->n_inputs != inputs.size()) {
+        error("\"%s\" was saved for %u inputs, not %zu", path, h->n_inputs, inputs.size());
+        goto clean;
+    }
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (stat(inputs[i].filename, &sb) < 0 || (uint64_t)sb.st_size != si[i].size) {
+            error("input %zu of \"%s\" is %s, not \"%s\"", i + 1, path, si[i].name, inputs[i].filename);
+            goto clean;
+        }
+        if (mtime_ns(&sb) != si[i].mtime) {
+            error("\"%s\" has changed since \"%s\" was saved", inputs[i].filename, path);
+            goto clean;
+        }
+    }
+
+    mp->reserve(h->n_keys);
+    for (uint64_t i = 0; i < h->n_keys; i++) {
+        mp->insert(std::make_pair(sm.keys[i].key, std::make_pair(sm.keys[i].id, sm.keys[i].qualsum)));
+    }
+    for (uint64_t i = 0; i < h->n_pending; i++) {
+        mates->pending[sm.mates[i].hash] = sm.mates[i].mate;
+    }
+    mates->order.assign(sm.order, sm.order + h->n_order);
+    state_add_stats(&sm, st, mates);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        inputs[i].ended = si[i].voffset == STATE_ENDED;
+        inputs[i].voffset = si[i].voffset;
+        inputs[i].n_read = si[i].n_read;
+        inputs[i].n_unplaced = si[i].n_unplaced;
+    }
+    ret = h->done;
+
+clean:
+    state_unmap(&sm);
+    return ret;
+}
+
+/* Merge the inputs' headers into one for the output. All inputs must have
+   the same references, their read groups, programs and comments are added. */
+static bam_hdr_t *merge_headers(std::vector<input_t>& inputs)
+{
+    bam_hdr_t *hdr = bam_hdr_dup(inputs[0].hdr);
+
+    for (size_t i = 1; hdr && i < inputs.size(); i++) {
+        const bam_hdr_t *h = inputs[i].hdr;
+        bool same = h->n_targets == hdr->n_targets;
+
+        for (int tid = 0; same && tid < h->n_targets; tid++) {
+            same = h->target_len[tid] == hdr->target_len[tid] &&
+                   !strcmp(h->target_name[tid], hdr->target_name[tid]);
+        }
+        if (!same) {
+            error("\"%s\" has different references than \"%s\"", inputs[i].filename, inputs[0].filename);
+            bam_hdr_destroy(hdr);
+            return NULL;
+        }
+
+        const char *line = sam_hdr_str(inputs[i].hdr), *end;
+        for (; line && *line; line = *end ? end + 1 : end) {
+            char type[3] = {0}, id[256] = {0};
+            const char *tag;
+            int found;
+
+            end = strchr(line, '\n');
+            if (!end)
+                end = line + strlen(line);
+            if (!strncmp(line, "@CO\t", 4)) {
+                std::string co(line, end - line + 1);
+                found = strstr(sam_hdr_str(hdr), co.c_str()) ? 0 : -1;
+            } else if (!strncmp(line, "@RG\t", 4) || !strncmp(line, "@PG\t", 4)) {
+                memcpy(type, line + 1, 2);
+                if (!(tag = strstr(line, "\tID:")) || tag > end)
+                    continue;
+                tag += 4;
+                snprintf(id, sizeof(id), "%.*s", (int)(strcspn(tag, "\t\n")), tag);
+                found = sam_hdr_find_line_id(hdr, type, "ID", id, NULL);
+            } else {
+                continue;
+            }
+            if (found == -1 && sam_hdr_add_lines(hdr, line, end - line) < 0) {
+                error("merging the header of \"%s\" failed", inputs[i].filename);
+                bam_hdr_destroy(hdr);
+                return NULL;
+            }
+        }
+    }
+    return hdr;
+}
+
+/* A survivor waiting to be written in coordinate order: its reference and
+   position, with unplaced reads last, and where it is in the sort arena. */
+typedef struct {
+    uint64_t pos;
+    uint64_t idx;
+} sort_rec_t;
+
+static inline bool sort_before(const sort_rec_t& a, const sort_rec_t& b)
+{
+    return a.pos < b.pos || (a.pos == b.pos && a.idx < b.idx);
+}
+
+static inline uint64_t sort_pos(const bam1_core_t *c)
+{
+    return ((uint64_t)(uint32_t)c->tid << 32) | (uint32_t)c->pos;
+}
+
+/* Survivors are sorted in memory and written out as temporary runs
+   whenever the arena is full. */
+typedef struct {
+    arena_t arena;
+    std::vector<sort_rec_t> order;
+    std::vector<std::string> runs;
+} sorter_t;
+
+typedef struct {
+    sort_rec_t *first, *mid, *last;
+} sort_job_t;
+
+/* Sort a slice, or merge two sorted halves when mid is past first. */
+static void *sort_job(void *arg)
+{
+    sort_job_t *j = (sort_job_t *)arg;
+    uint64_t t = trace_begin();
+
+    if (j->mid == j->first)
+        std::sort(j->first, j->last, sort_before);
+    else
+        std::inplace_merge(j->first, j->mid, j->last, sort_before);
+    trace_end(j->mid == j->first ? "sort" : "merge", t);
+    return NULL;
+}
+
+/* Sort on the thread pool: one slice per thread, then merge neighbouring
+   slices pairwise until one is left. */
+static void sort_parallel(std::vector<sort_rec_t>& v, hts_tpool *pool)
+{
+    size_t threads = hts_tpool_size(pool), n = v.size(), slice = (n + threads - 1) / threads, w, i;
+    std::vector<sort_job_t> jobs;
+    hts_tpool_process *q;
+
+    if (n < SORT_MIN_PARALLEL || !(q = hts_tpool_process_init(pool, 2 * threads, 1))) {
+        std::sort(v.begin(), v.end(), sort_before);
+        return;
+    }
+    sort_rec_t *base = v.data();
+    for (w = 0; w < n; w = w ? w * 2 : slice) {
+        jobs.clear();
+        for (i = 0; i < n; i += w ? 2 * w : slice) {
+            sort_job_t j;
+            j.first = base + i;
+            j.mid = w ? base + std::min(i + w, n) : j.first;
+            j.last = base + std::min(i + (w ? 2 * w : slice), n);
+            if (j.mid != j.last)
+                jobs.push_back(j);
+        }
+        for (i = 0; i < jobs.size(); i++) {
+            hts_tpool_dispatch(pool, q, sort_job, &jobs[i]);
+        }
+        hts_tpool_process_flush(q);
+    }
+    hts_tpool_process_destroy(q);
+}
+
+/* Runs of the sorter at work. They are removed at exit, also when doopa
+   gives up half way, so no temporary runs are left behind. */
+static const std::vector<std::string> *spilled_runs;
+
+static void remove_runs(void)
+{
+    for (size_t i = 0; spilled_runs && i < spilled_runs->size(); i++) {
+        unlink((*spilled_runs)[i].c_str());
+    }
+}
+
+/* Write the buffered survivors out in order as a temporary run and empty the buffer. */
+static int sorter_spill(sorter_t *s, bam_hdr_t *hdr, htsThreadPool *p)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    samFile *fp = NULL;
+    hFILE *hf = NULL;
+    bam1_t view;
+    size_t i;
+    int fd;
+
+    // a name of its own, created only by us, in a shared directory
+    snprintf(path, sizeof(path), "%s/doopa.XXXXXX.bam", tmpdir && *tmpdir ? tmpdir : "/tmp");
+    if ((fd = mkstemps(path, 4)) < 0) {
+        error("Couldn't create a temporary run in \"%s\": %s", tmpdir && *tmpdir ? tmpdir : "/tmp", strerror(errno));
+        return -1;
+    }
+    if (!spilled_runs) {
+        spilled_runs = &s->runs;
+        atexit(remove_runs);
+    }
+    s->runs.push_back(path);
+    if (!(hf = hdopen(fd, "w")) || !(fp = hts_hopen(hf, path, "wb1"))) {
+        error("Couldn't open \"%s\" for writing", path);
+        if (hf)
+            hclose_abruptly(hf);
+        else
+            close(fd);
+        return -1;
+    }
+    hts_set_opt(fp, HTS_OPT_THREAD_POOL, p);
+
+    sort_parallel(s->order, p->pool);
+    if (sam_hdr_write(fp, hdr) < 0)
+        goto fail;
+    for (i = 0; i < s->order.size(); i++) {
+        arena_view(arena_get(&s->arena, s->order[i].idx), &view);
+        if (sam_write1(fp, hdr, &view) < 0)
+            goto fail;
+    }
+    if (sam_close(fp) < 0)
+        return -1;
+    arena_destroy(&s->arena);
+    s->order.clear();
+    return 0;
+
+fail:
+    sam_close(fp);
+    return -1;
+}
+
+/* Add a survivor, spilling the buffered ones to a run first if it is full. */
+static int sorter_add(sorter_t *s, const bam1_t *b, bam_hdr_t *hdr, htsThreadPool *p)
+{
+    int64_t i = arena_push(&s->arena, b, 0);
+    sort_rec_t r;
+
+    if (i < 0) {
+        if (s->order.empty() || sorter_spill(s, hdr, p) < 0)
+            return -1;
+        if ((i = arena_push(&s->arena, b, 0)) < 0)
+            return -1;
+    }
+    r.pos = sort_pos(&b->core);
+    r.idx = i;
+    s->order.push_back(r);
+    return 0;
+}
+
+/* Merge the runs and what is still buffered into out. Runs hold older reads
+   than the buffer and come first among reads at the same position. */
+static int sorter_write(sorter_t *s, samFile *out, bam_hdr_t *hdr, htsThreadPool *p)
+{
+    size_t n_runs = s->runs.size(), next = 0, i;
+    std::vector<input_t> srcs(n_runs + 1);
+    input_after after = { &srcs };
+    input_heap_t heap(after);
+    bam1_t view;
+    int r, ret = -1;
+
+    sort_parallel(s->order, p->pool);
+    for (i = 0; i < n_runs; i++) {
+        input_t *in = &srcs[i];
+        in->filename = s->runs[i].c_str();
+        if (!(in->fp = sam_open(in->filename, "r")) || !(in->hdr = sam_hdr_read(in->fp))) {
+            error("reading \"%s\" failed", in->filename);
+            goto out;
+        }
+        hts_set_opt(in->fp, HTS_OPT_THREAD_POOL, p);
+        if (!(in->b = bam_init1())) { error("can't create record"); exit(1); }
+        if (sam_read1(in->fp, in->hdr, in->b) >= 0)
+            heap.push(i);
+    }
+    // the buffer is the last source, its reads are viewed in place
+    srcs[n_runs].b = &view;
+    if (next < s->order.size()) {
+        arena_view(arena_get(&s->arena, s->order[next++].idx), &view);
+        heap.push(n_runs);
+    }
+
+    while (!heap.empty()) {
+        input_t *in = &srcs[heap.top()];
+        heap.pop();
+        if (sam_write1(out, hdr, in->b) < 0)
+            goto out;
+        if (in == &srcs[n_runs]) {
+            if (next < s->order.size()) {
+                arena_view(arena_get(&s->arena, s->order[next++].idx), &view);
+                heap.push(n_runs);
+            }
+        } else if ((r = sam_read1(in->fp, in->hdr, in->b)) >= 0) {
+            heap.push(in - &srcs[0]);
+        } else if (r < -1) {
+            error("reading \"%s\" failed", in->filename);
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    for (i = 0; i < n_runs; i++) {
+        input_t *in = &srcs[i];
+        if (in->b) bam_destroy1(in->b);
+        if (in->hdr) bam_hdr_destroy(in->hdr);
+        if (in->fp) sam_close(in->fp);
+    }
+    return ret;
+}
+
+static void sorter_destroy(sorter_t *s)
+{
+    remove_runs();
+    spilled_runs = NULL;
+    s->runs.clear();
+    s->order.clear();
+    arena_destroy(&s->arena);
+}
+
+/* Deduplicate unsorted input, such as straight from the aligner, and write the
+   survivors in coordinate order. Winners are picked in the first pass, so only
+   they are read again and sorted, and duplicates never reach the temporary runs.
+   Mates can turn up in either order, the first one waits in the mate cache. */
+static void dedup_sort(char **filenames, int n_files, const doopa_opts_t *opts)
+{
+    htsThreadPool p = {NULL, 0};
+    dedup_stats_t st = {0};
+    uint64_t qualsum, voffset, id;
+    chrposlen_t key;
+    mate_cache_t mates;
+    pending_mate_t mate;
+    bam1_t *b;
+    bam_hdr_t *hdr = NULL;
+    samFile *out = NULL;
+    std::vector<input_t> inputs(n_files);
+    sorter_t sorter;
+    std::string fnidx;
+    int i, ret;
+
+    mates.max = MATE_CACHE_SIZE;
+    mates.found = mates.guessed = 0;
+    sorter.arena.page_used = 0;
+    sorter.arena.bytes = 0;
+    sorter.arena.limit = opts->max_memory ? opts->max_memory : SORT_MEMORY;
+
+    doopa_t mp(1000000, opts->compact_keys);
+    std::vector<uint64_t> survivors;
+
+    if (threads_init(&p, opts) < 0) {
+        error("error creating thread pool");
+        goto clean;
+    }
+
+    for (i = 0; i < n_files; i++) {
+        input_t *in = &inputs[i];
+
+        in->filename = filenames[i];
+        if (input_open(in, opts, &p) < 0) {
+            error("Couldn't open \"%s\"", in->filename);
+            exit(1);
+        }
+
+        in->hdr = input_read_header(in, opts, &p);
+        if (in->hdr == NULL) {
+            errno = 0; error("reading headers from \"%s\" failed", in->filename);
+            goto clean;
+        }
+        if (!(in->b = bam_init1())) { error("can't create record"); exit(1); }
+    }
+
+    if (!(out = open_output(opts, &p)))
+        goto clean;
+
+    if (!(hdr = merge_headers(inputs)))
+        goto clean;
+
+    if (sam_hdr_count_lines(hdr, "HD") > 0)
+        ret = sam_hdr_update_hd(hdr, "SO", "coordinate");
+    else
+        ret = sam_hdr_add_line(hdr, "HD", "VN", SAM_FORMAT_VERSION, "SO", "coordinate", NULL);
+    if (ret < 0) {
+        error("setting the sort order in the header failed");
+        goto clean;
+    }
+
+    if (!opts->stats_only) {
+        if (sam_hdr_write(out, hdr) != 0) {
+            error("writing headers to %s failed", out_name(opts));
+            goto clean;
+        }
+        if (opts->write_index) {
+            fnidx = std::string(opts->out_file) + (out->format.format == cram ? ".crai" : ".bai");
+            if (sam_idx_init(out, hdr, 0, fnidx.c_str()) < 0) {
+                error("creating the index \"%s\" failed", fnidx.c_str());
+                goto clean;
+            }
+        }
+    }
+
+    pin_opened_threads(opts);
+    error("Start deduping and sorting...");
+
+    for (i = 0; i < n_files; i++) {
+        input_t *in = &inputs[i];
+        b = in->b;
+
+        for (;;) {
+            if ((ret = input_read(in, &voffset)) < -1) {
+                error("reading \"%s\" failed", in->filename);
+                exit(1);
+            }
+            if (ret < 0)
+                break;
+            id = READ_ID(i, voffset);
+
+            st.total_reads++;
+            if (*opts->debugread && !strncmp((const char *)b->data, opts->debugread, 128)) {
+                error("found debugread %s", opts->debugread);
+            }
+            if (b->core.tid < 0) {
+                // unplaced reads are all kept, they sort last
+                survivors.push_back(id);
+                continue;
+            }
+            if (!count_read(&st, b))
+                continue;
+            qualsum = get_qualsum(b, &st.total_bases, &st.bases_above_q30);
+            if (needs_mate(b) && mate_cache_take(&mates, b, &mate)) {
+                key.lo = pack_end(b);
+                key.hi = mate.end;
+                add_read(&mp, key, id, qualsum, &st);
+                key.hi = key.lo;
+                key.lo = mate.end;
+                add_read(&mp, key, mate.id, mate.qualsum, &st);
+            } else if (needs_mate(b)) {
+                if (mate_cache_put(&mates, b, id, qualsum, &mate))
+                    add_read(&mp, mate.fallback, mate.id, mate.qualsum, &st);
+            } else {
+                make_key(&key, b);
+                add_read(&mp, key, id, qualsum, &st);
+            }
+        }
+    }
+    while (mate_cache_pop(&mates, &mate)) {
+        add_read(&mp, mate.fallback, mate.id, mate.qualsum, &st);
+    }
+    print_stats(&st);
+    print_collisions(mp);
+    print_mate_stats(&mates);
+
+    if (!opts->stats_only) {
+        survivors.reserve(survivors.size() + mp.size());
+        for (doopa_t::iterator it = mp.begin(); it != mp.end(); it++) {
+            survivors.push_back(std::get<0>(it->second));
+        }
+        mp.clear();
+        std::sort(survivors.begin(), survivors.end());
+
+        size_t start = 0, end;
+        for (i = 0; i < n_files; i++) {
+            input_t *in = &inputs[i];
+            for (end = start; end < survivors.size() && READ_INPUT(survivors[end]) == i; end++)
+                ;
+            in->survivors = survivors.data() + start;
+            in->n_survivors = end - start;
+            in->next = 0;
+            start = end;
+            if (in->cram && input_reopen(in, opts, &p) < 0) {
+                error("reopening \"%s\" failed", in->filename);
+                exit(1);
+            }
+            while ((ret = input_next_survivor(in)) > 0) {
+                if (sorter_add(&sorter, in->b, hdr, &p) < 0) {
+                    error("writing a temporary run failed");
+                    exit(1);
+                }
+            }
+            if (ret < 0) {
+                error("reading \"%s\" failed", in->filename);
+                exit(1);
+            }
+        }
+        if (sorter.runs.size())
+            error("Merging %zu temporary runs", sorter.runs.size());
+        if (sorter_write(&sorter, out, hdr, &p) < 0) {
+            error("writing to %s failed", out_name(opts));
+            exit(1);
+        }
+        if (opts->write_index && sam_idx_save(out) < 0) {
+            error("writing the index \"%s\" failed", fnidx.c_str());
+            exit(1);
+        }
+    }
+    error("Done");
+
+clean:
+    sorter_destroy(&sorter);
+    for (i = 0; i < n_files; i++) {
+        input_t *in = &inputs[i];
+        sam_text_destroy(in->text);
+        reader_close(in->reader);
+        if (in->b) bam_destroy1(in->b);
+        if (in->hdr) bam_hdr_destroy(in->hdr);
+        if (in->fp) sam_close(in->fp);
+    }
+    bam_hdr_destroy(hdr);
+    if (sam_close(out) < 0) {
+        error("could not close output file");
+    }
+    if (p.pool) hts_tpool_destroy(p.pool);
+}
+
+/* A region of the reference, 0-based and half open. */
+typedef struct {
+    int tid;
+    hts_pos_t beg, end;
+} region_t;
+
+static inline bool region_before(const region_t& a, const region_t& b)
+{
+    return a.tid < b.tid || (a.tid == b.tid && a.beg < b.beg);
+}
+
+/* Regions near each other, deduplicated by one job of the thread pool. */
+typedef struct {
+    const char *filename;
+    std::vector<region_t> regions;
+    std::vector<hts_pair64_t> chunks;   // of the index, in file order
+    region_t prev;      // last region of the group before, reads overlapping it are its own
+    bool compact_keys;
+    std::vector<uint64_t> survivors;
+    dedup_stats_t st;
+    mate_cache_t mates;
+    int ret;
+} region_group_t;
+
+/* Read the regions of --region and --regions-file, sorted and merged where
+   they overlap. */
+static int read_regions(const doopa_opts_t *opts, bam_hdr_t *hdr, std::vector<region_t> *regions)
+{
+    char line[1024], name[256];
+    long long beg, end;
+    int n_line = 0;
+    region_t r;
+    size_t n = 0;
+    FILE *fp;
+
+    for (int i = 0; i < opts->n_regions; i++) {
+        if (!sam_parse_region(hdr, opts->regions[i], &r.tid, &r.beg, &r.end, HTS_PARSE_THOUSANDS_SEP) ||
+                r.tid < 0) {
+            errno = 0; error("bad region \"%s\"", opts->regions[i]);
+            return -1;
+        }
+        regions->push_back(r);
+    }
+    if (opts->regions_file) {
+        if (!(fp = fopen(opts->regions_file, "r"))) {
+            error("Couldn't open \"%s\"", opts->regions_file);
+            return -1;
+        }
+        // bed, with 0-based starts
+        while (fgets(line, sizeof(line), fp)) {
+            n_line++;
+            if (*line == '#' || *line == '\n' || !strncmp(line, "track", 5) || !strncmp(line, "browser", 7))
+                continue;
+            if (sscanf(line, "%255s %lld %lld", name, &beg, &end) != 3 ||
+                    (r.tid = sam_hdr_name2tid(hdr, name)) < 0 || beg < 0 || end <= beg) {
+                errno = 0; error("bad region on line %d of \"%s\"", n_line, opts->regions_file);
+                fclose(fp);
+                return -1;
+            }
+            r.beg = beg;
+            r.end = end;
+            regions->push_back(r);
+        }
+        fclose(fp);
+    }
+
+    std::sort(regions->begin(), regions->end(), region_before);
+    for (size_t i = 0; i < regions->size(); i++) {
+        region_t *cur = &(*regions)[i], *last = n ? &(*regions)[n - 1] : NULL;
+        if (last && last->tid == cur->tid && cur->beg <= last->end)
+            last->end = std::max(last->end, cur->end);
+        else
+            (*regions)[n++] = *cur;
+    }
+    regions->resize(n);
+    return 0;
+}
+
+/* Put regions less than REGION_GAP apart into the same group and find the
+   chunks of the index each group has to read. */
+static int region_groups(const std::vector<region_t>& regions, region_t first, const hts_idx_t *idx,
+                         bam_hdr_t *hdr, const char *filename, std::vector<region_group_t *> *groups)
+{
+    region_group_t *g = NULL;
+    std::vector<std::string> names;
+    std::vector<char *> regarray;
+    hts_itr_t *iter;
+    char buf[64];
+
+    for (size_t i = 0; i < regions.size(); i++) {
+        const region_t *r = &regions[i];
+        if (!g || g->regions.back().tid != r->tid || r->beg - g->regions.back().end >= REGION_GAP) {
+            g = new region_group_t();
+            g->filename = filename;
+            g->prev = groups->empty() ? first : groups->back()->regions.back();
+            groups->push_back(g);
+        }
+        g->regions.push_back(*r);
+    }
+
+    for (size_t i = 0; i < groups->size(); i++) {
+        g = (*groups)[i];
+        names.clear();
+        regarray.clear();
+        for (size_t j = 0; j < g->regions.size(); j++) {
+            const region_t *r = &g->regions[j];
+            snprintf(buf, sizeof(buf), ":%lld-%lld", (long long)r->beg + 1,
+                     (long long)std::min(r->end, sam_hdr_tid2len(hdr, r->tid)));
+            names.push_back(std::string(sam_hdr_tid2name(hdr, r->tid)) + buf);
+        }
+        for (size_t j = 0; j < names.size(); j++) {
+            regarray.push_back(&names[j][0]);
+        }
+        if (!(iter = sam_itr_regarray(idx, hdr, regarray.data(), regarray.size())))
+            return -1;
+        for (int k = 0; k < iter->n_off; k++) {
+            hts_pair64_t chunk = { iter->off[k].u, iter->off[k].v };
+            g->chunks.push_back(chunk);
+        }
+        hts_itr_destroy(iter);
+    }
+    return 0;
+}
+
+/* Whether a read overlaps one of the sorted, disjoint regions. */
+static bool region_overlapped(const std::vector<region_t>& regions, const bam1_t *b)
+{
+    const bam1_core_t *c = &b->core;
+    size_t lo = 0, hi = regions.size(), mid;
+
+    // the first region ending after the read starts is the only one it can start in
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (regions[mid].tid < c->tid || (regions[mid].tid == c->tid && regions[mid].end <= c->pos))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < regions.size() && regions[lo].tid == c->tid && regions[lo].beg < bam_endpos(b);
+}
+
+/* Pass 1 over a group of regions, on a thread of its own with its own
+   handle on the file. */
+static void *region_job(void *arg)
+{
+    region_group_t *g = (region_group_t *)arg;
+    doopa_t mp(1024, g->compact_keys);
+    pending_mate_t mate;
+    BGZF *fp = NULL;
+    bam1_t *b;
+    uint64_t voffset, qualsum, t = trace_begin();
+    int ret = 0;
+
+    g->ret = -1;
+    g->mates.max = MATE_CACHE_SIZE;
+    g->mates.found = g->mates.guessed = 0;
+    if (!(b = bam_init1()) || !(fp = bgzf_open(g->filename, "r")))
+        goto clean;
+
+    for (size_t k = 0; ret >= 0 && k < g->chunks.size(); k++) {
+        if (bgzf_seek(fp, g->chunks[k].u, SEEK_SET) < 0)
+            goto clean;
+        while ((voffset = bgzf_tell(fp)) < g->chunks[k].v && (ret = bam_read1(fp, b)) >= 0) {
+            const bam1_core_t *c = &b->core;
+            if ((c->tid == g->prev.tid && c->pos < g->prev.end) || !region_overlapped(g->regions, b))
+                continue;
+            g->st.total_reads++;
+            if (count_read(&g->st, b)) {
+                qualsum = get_qualsum(b, &g->st.total_bases, &g->st.bases_above_q30);
+                add_sorted_read(&mp, &g->mates, b, voffset, qualsum, &g->st);
+            }
+        }
+        if (ret == -1)
+            ret = 0;
+    }
+    if (ret < 0)
+        goto clean;
+    while (mate_cache_pop(&g->mates, &mate)) {
+        add_read(&mp, mate.fallback, mate.id, mate.qualsum, &g->st);
+    }
+    g->survivors.reserve(mp.size());
+    for (doopa_t::iterator it = mp.begin(); it != mp.end(); it++) {
+        g->survivors.push_back(std::get<0>(it->second));
+    }
+    std::sort(g->survivors.begin(), g->survivors.end());
+    g->ret = 0;
+
+clean:
+    if (fp) bgzf_close(fp);
+    if (b) bam_destroy1(b);
+    trace_end("region group", t);
+    return g;
+}
+
+/* Compressed bytes of the input holding the reads of part of a reference,
+   as the index has it. */
+static uint64_t index_bytes(const hts_idx_t *idx, int tid, hts_pos_t beg, hts_pos_t end)
+{
+    hts_itr_t *iter;
+    uint64_t n = 0;
+
+    if (!(iter = sam_itr_queryi(idx, tid, beg, end)))
+        return 0;
+    for (int k = 0; k < iter->n_off; k++) {
+        n += (iter->off[k].v >> 16) - (iter->off[k].u >> 16);
+    }
+    hts_itr_destroy(iter);
+    return n;
+}
+
+/* Split the references into n_shards stretches with about as many reads
+   each, going by the index, and give the regions of shard i (from 1).
+   Shards that start inside a reference leave the reads starting before
+   that to the shard before, through first. */
+static int shard_regions(const hts_idx_t *idx, bam_hdr_t *hdr, int shard, int n_shards,
+                         std::vector<region_t> *regions, region_t *first)
+{
+    std::vector<uint64_t> reads(hdr->n_targets);
+    uint64_t mapped, unmapped, total = 0, before = 0, target, whole;
+    region_t from = { 0, 0, 0 }, to = { hdr->n_targets, 0, 0 }, *bound;
+    hts_pos_t lo, hi, mid;
+    int tid = 0;
+
+    for (int t = 0; t < hdr->n_targets; t++) {
+        if (hts_idx_get_stat(idx, t, &mapped, &unmapped) == 0)
+            reads[t] = mapped + unmapped;
+        total += reads[t];
+    }
+
+    // where shards shard - 1 and shard start
+    for (int k = shard - 1; k <= shard; k++) {
+        if (k == 0 || k == n_shards)
+            continue;
+        bound = k == shard - 1 ? &from : &to;
+        target = total * k / n_shards;
+        for (tid = 0, before = 0; tid < hdr->n_targets - 1 && before + reads[tid] <= target; tid++)
+            before += reads[tid];
+        bound->tid = tid;
+        // within the reference, by how much of the input is before
+        whole = index_bytes(idx, tid, 0, HTS_POS_MAX);
+        lo = 0;
+        hi = sam_hdr_tid2len(hdr, tid);
+        while (whole && reads[tid] && lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if ((double)index_bytes(idx, tid, 0, mid) / whole < (double)(target - before) / reads[tid])
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        bound->beg = lo;
+    }
+
+    for (tid = from.tid; tid <= to.tid && tid < hdr->n_targets; tid++) {
+        region_t r = { tid, tid == from.tid ? from.beg : 0,
+                       tid == to.tid ? to.beg : sam_hdr_tid2len(hdr, tid) };
+        if (r.beg < r.end && reads[tid])
+            regions->push_back(r);
+    }
+    first->tid = from.beg ? from.tid : -1;
+    first->beg = 0;
+    first->end = from.beg;
+    return 0;
+}
+
+/* What a shard leaves for doopa merge: its statistics, and where its
+   reads start in its output, next to it as FILE.metrics. */
+static int write_metrics(const char *filename, const dedup_stats_t *st, const mate_cache_t *mates,
+                         uint64_t records_start)
+{
+    std::string path = std::string(filename) + ".metrics";
+    FILE *fp;
+
+    if (!(fp = fopen(path.c_str(), "w")))
+        return -1;
+    fprintf(fp, "records_start\t%" PRIu64 "\n", records_start);
+    fprintf(fp, "total_reads\t%" PRIu64 "\n", st->total_reads);
+    fprintf(fp, "paired_reads\t%" PRIu64 "\n", st->paired_reads);
+    fprintf(fp, "mapped_reads\t%" PRIu64 "\n", st->mapped_reads);
+    fprintf(fp, "bases_above_q30\t%" PRIu64 "\n", st->bases_above_q30);
+    fprintf(fp, "total_bases\t%" PRIu64 "\n", st->total_bases);
+    fprintf(fp, "duplicate_reads\t%" PRIu64 "\n", st->duplicate_reads);
+    fprintf(fp, "mates_found\t%" PRIu64 "\n", mates->found);
+    fprintf(fp, "mates_guessed\t%" PRIu64 "\n", mates->guessed);
+    for (fragment_t::const_iterator it = st->fragment_histogram.begin();
+            it != st->fragment_histogram.end(); it++) {
+        fprintf(fp, "fragment\t%" PRIu64 "\t%" PRIu64 "\n", it->first, it->second);
+    }
+    return fclose(fp);
+}
+
+/* Add the metrics of a shard to st and mates. */
+static int read_metrics(const char *filename, dedup_stats_t *st, mate_cache_t *mates,
+                        uint64_t *records_start)
+{
+    std::string path = std::string(filename) + ".metrics";
+    char name[32];
+    uint64_t v, n;
+    FILE *fp;
+    int ret = 0;
+
+    if (!(fp = fopen(path.c_str(), "r")))
+        return -1;
+    while (ret == 0 && fscanf(fp, "%31s %" SCNu64, name, &v) == 2) {
+        if (!strcmp(name, "records_start")) *records_start = v;
+        else if (!strcmp(name, "total_reads")) st->total_reads += v;
+        else if (!strcmp(name, "paired_reads")) st->paired_reads += v;
+        else if (!strcmp(name, "mapped_reads")) st->mapped_reads += v;
+        else if (!strcmp(name, "bases_above_q30")) st->bases_above_q30 += v;
+        else if (!strcmp(name, "total_bases")) st->total_bases += v;
+        else if (!strcmp(name, "duplicate_reads")) st->duplicate_reads += v;
+        else if (!strcmp(name, "mates_found")) mates->found += v;
+        else if (!strcmp(name, "mates_guessed")) mates->guessed += v;
+        else if (!strcmp(name, "fragment") && fscanf(fp, "%" SCNu64, &n) == 1)
+            st->fragment_histogram[v] += n;
+        else
+            ret = -1;
+    }
+    if (!feof(fp))
+        ret = -1;
+    fclose(fp);
+    return ret;
+}
+
+/* Deduplicate only the reads overlapping the given regions of an indexed
+   bam file, or those of one shard of it. Groups of regions go through
+   pass 1 at the same time, each is written as soon as it and those
+   before it are done. */
+static void dedup_regions(const char *filename, const doopa_opts_t *opts)
+{
+    htsThreadPool p = {NULL, 0};
+    hts_tpool_process *q = NULL;
+    hts_tpool_result *r;
+    dedup_stats_t st = {0};
+    mate_cache_t mates;
+    std::vector<region_t> regions;
+    std::vector<region_group_t *> groups;
+    region_group_t *g;
+    region_t first = { -1, 0, 0 };
+    uint64_t records_start = 0;
+    bool last_shard = opts->n_shards && opts->shard == opts->n_shards;
+    samFile *out = NULL;
+    input_t in;
+    int ret;
+
+    memset(&in, 0, sizeof(in));
+    in.filename = filename;
+    mates.found = mates.guessed = 0;
+
+    if (threads_init(&p, opts) < 0) {
+        error("error creating thread pool");
+        goto clean;
+    }
+    if (input_open(&in, opts, &p) < 0) {
+        error("Couldn't open \"%s\"", filename);
+        exit(1);
+    }
+    if (!(in.idx = sam_index_load(in.fp, filename))) {
+        error("cannot open index of \"%s\"", filename);
+        exit(1);
+    }
+    if (!(in.hdr = input_read_header(&in, opts, &p)) || !(in.b = bam_init1())) {
+        errno = 0; error("reading headers from \"%s\" failed", filename);
+        goto clean;
+    }
+    if (opts->n_shards) {
+        shard_regions(in.idx, in.hdr, opts->shard, opts->n_shards, &regions, &first);
+    } else if (read_regions(opts, in.hdr, &regions) < 0) {
+        exit(1);
+    }
+    if (region_groups(regions, first, in.idx, in.hdr, filename, &groups) < 0) {
+        error("looking up the regions in the index of \"%s\" failed", filename);
+        goto clean;
+    }
+    for (size_t i = 0; i < groups.size(); i++) {
+        groups[i]->compact_keys = opts->compact_keys;
+    }
+
+    if (!(out = open_output(opts, &p)))
+        goto clean;
+    if (!opts->stats_only && sam_hdr_write(out, in.hdr) != 0) {
+        error("writing headers to %s failed", out_name(opts));
+        goto clean;
+    }
+    if (opts->n_shards) {
+        // reads start in a block of their own, so doopa merge can drop the header
+        if (bgzf_flush(out->fp.bgzf) < 0) {
+            error("writing headers to %s failed", out_name(opts));
+            goto clean;
+        }
+        records_start = bgzf_tell(out->fp.bgzf) >> 16;
+    }
+
+    pin_opened_threads(opts);
+    error("Start deduping %zu regions in %zu groups...", regions.size(), groups.size());
+
+    // every group is queued at once, results come back in order; the jobs
+    // share the pool with the input and output, each reads on its own
+    if (!(q = hts_tpool_process_init(p.pool, std::max(groups.size(), (size_t)1), 0))) {
+        error("error creating thread pool");
+        goto clean;
+    }
+    for (size_t i = 0; i < groups.size(); i++) {
+        if (hts_tpool_dispatch(p.pool, q, region_job, groups[i]) < 0) {
+            error("error creating thread pool");
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < groups.size(); i++) {
+        if (!(r = hts_tpool_next_result_wait(q))) {
+            error("deduping \"%s\" failed", filename);
+            exit(1);
+        }
+        g = (region_group_t *)hts_tpool_result_data(r);
+        hts_tpool_delete_result(r, 0);
+        if (g->ret < 0) {
+            error("reading \"%s\" failed", filename);
+            exit(1);
+        }
+        merge_stats(&st, &g->st);
+        mates.found += g->mates.found;
+        mates.guessed += g->mates.guessed;
+
+        if (!opts->stats_only) {
+            // groups are in coordinate order, and so in file order
+            in.survivors = g->survivors.data();
+            in.n_survivors = g->survivors.size();
+            in.next = 0;
+            while ((ret = input_next_survivor(&in)) > 0) {
+                if (sam_write1(out, in.hdr, in.b) < 0) {
+                    error("writing to %s failed", out_name(opts));
+                    exit(1);
+                }
+            }
+            if (ret < 0) {
+                error("reading \"%s\" failed", filename);
+                exit(1);
+            }
+        }
+        g->survivors.clear();
+    }
+    if (last_shard) {
+        // the unplaced reads go with the last shard
+        st.total_reads += hts_idx_get_n_no_coor(in.idx);
+        if (!opts->stats_only && hts_idx_get_n_no_coor(in.idx) &&
+                write_unplaced(in.fp, out, in.hdr, in.b, unplaced_offset(in.idx)) < 0) {
+            error("writing unplaced reads to %s failed", out_name(opts));
+            exit(1);
+        }
+    }
+    print_stats(&st);
+    print_mate_stats(&mates);
+    if (opts->n_shards && write_metrics(opts->out_file, &st, &mates, records_start) < 0) {
+        error("writing \"%s.metrics\" failed", opts->out_file);
+        exit(1);
+    }
+    error("Done");
+
+clean:
+    if (q) hts_tpool_process_destroy(q);
+    for (size_t i = 0; i < groups.size(); i++) {
+        delete groups[i];
+    }
+    reader_close(in.reader);
+    if (in.b) bam_destroy1(in.b);
+    if (in.idx) hts_idx_destroy(in.idx);
+    if (in.hdr) bam_hdr_destroy(in.hdr);
+    if (in.fp) sam_close(in.fp);
+    if (out && sam_close(out) < 0) {
+        error("could not close output file");
+    }
+    if (p.pool) hts_tpool_destroy(p.pool);
+}
+
+// Phases of a run timed with --profile
+enum { PHASE_OPEN, PHASE_PASS1, PHASE_STATS, PHASE_PASS2, PHASE_CLOSE, N_PHASES };
+
+static const char *phase_names[N_PHASES] = { "open", "pass1", "stats", "pass2", "close" };
+
+// Hardware events counted on the main thread with --profile
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_LLC_MISSES, PERF_DTLB_MISSES, PERF_BRANCH_MISSES, N_PERF };
+
+static const char *perf_names[N_PERF] = {
+    "cycles", "instructions", "llc_misses", "dtlb_misses", "branch_misses"
+};
+
+/* What --profile measures. Wall time, CPU time of all threads and of the
+   main thread are taken per phase. One read in PROFILE_SAMPLE of each pass
+   is timed: how long the main loop spent on it (keying it in pass 1,
+   writing it in pass 2), and how long getting the next read took. The
+   queue of the input it came from is looked at then, when doopa inflates
+   the blocks itself (--mmap or --prefetch). */
+typedef struct {
+    bool on;
+    int phase;
+    uint64_t wall0, cpu0, main0;    // when the current phase started
+    uint64_t wall[N_PHASES], cpu[N_PHASES], main[N_PHASES];
+    uint64_t records[N_PHASES];
+    uint64_t samples[N_PHASES], loop[N_PHASES], reading[N_PHASES];
+    uint64_t queue_samples, queue_ready, queue_busy, queue_size;
+    // the winner table at the end of pass 1
+    uint64_t keys, lookups, probes, grows, table_bytes;
+    double load;
+    // hardware counters, -1 for those the kernel would not give
+    int perf_fd[N_PERF];
+    uint64_t perf0[N_PERF];
+    uint64_t perf[N_PHASES][N_PERF];
+} profile_t;
+
+/* Open the hardware counters of the main thread, where the pass loops
+   run. Each one is opened on its own, so a machine or a virtual machine
+   without one of them still gets the others. */
+static void perf_open(profile_t *pr)
+{
+    static const uint32_t types[N_PERF] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE
+    };
+    static const uint64_t configs[N_PERF] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    struct perf_event_attr attr;
+    int i, n = 0, err = 0;
+
+    for (i = 0; i < N_PERF; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[i];
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        if ((pr->perf_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0)) < 0)
+            err = errno;
+        else
+            n++;
+    }
+    if (!n && (err == EACCES || err == EPERM))
+        error("Hardware counters are not allowed, see kernel.perf_event_paranoid");
+    else if (!n)
+        error("Hardware counters are not available: %s", strerror(err));
+}
+
+/* Read a counter, scaled up for the time it was not running when the
+   kernel had to share the hardware between more events. */
+static uint64_t perf_read(int fd)
+{
+    uint64_t v[3];
+
+    if (fd < 0 || read(fd, v, sizeof(v)) != sizeof(v) || !v[2])
+        return 0;
+    return v[2] < v[1] ? (uint64_t)((double)v[0] * v[1] / v[2]) : v[0];
+}
+
+static void profile_init(profile_t *pr, bool on)
+{
+    memset(pr, 0, sizeof(*pr));
+    pr->on = on;
+    pr->phase = PHASE_OPEN;
+    pr->wall0 = now_ns();
+    pr->cpu0 = cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+    pr->main0 = cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+    for (int i = 0; i < N_PERF; i++)
+        pr->perf_fd[i] = -1;
+    if (!on)
+        return;
+    perf_open(pr);
+    for (int i = 0; i < N_PERF; i++)
+        pr->perf0[i] = perf_read(pr->perf_fd[i]);
+}
+
+/* End the current phase and start the next one, N_PHASES ends the run. */
+static void profile_phase(profile_t *pr, int phase)
+{
+    uint64_t wall, cpu, main;
+
+    if ((!pr->on && !tracer.path) || pr->phase == N_PHASES)
+        return;
+    wall = now_ns();
+    trace_end(phase_names[pr->phase], pr->wall0);
+    cpu = cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+    main = cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+    pr->wall[pr->phase] += wall - pr->wall0;
+    pr->cpu[pr->phase] += cpu - pr->cpu0;
+    pr->main[pr->phase] += main - pr->main0;
+    pr->wall0 = wall;
+    pr->cpu0 = cpu;
+    pr->main0 = main;
+    for (int i = 0; i < N_PERF; i++) {
+        uint64_t v = perf_read(pr->perf_fd[i]);
+        pr->perf[pr->phase][i] += v - pr->perf0[i];
+        pr->perf0[i] = v;
+        if (phase == N_PHASES && pr->perf_fd[i] >= 0)
+            close(pr->perf_fd[i]);
+    }
+    pr->phase = phase;
+}
+
+/* Whether to time this read, the n-th of the phase. */
+static inline bool profile_sampled(const profile_t *pr, uint64_t n)
+{
+    return pr->on && n % PROFILE_SAMPLE == 0;
+}
+
+/* A timed read: the main loop had it from t0 to t1, and got the next one
+   from then to now. */
+static void profile_sample(profile_t *pr, uint64_t t0, uint64_t t1, const bgzf_reader_t *reader)
+{
+    pr->samples[pr->phase]++;
+    pr->loop[pr->phase] += t1 - t0;
+    pr->reading[pr->phase] += now_ns() - t1;
+    if (reader) {
+        pr->queue_samples++;
+        pr->queue_ready += hts_tpool_process_len(reader->q);
+        pr->queue_busy += hts_tpool_process_sz(reader->q);
+        pr->queue_size = hts_tpool_process_qsize(reader->q);
+    }
+}
+
+static void profile_table(profile_t *pr, const doopa_t& mp)
+{
+    pr->keys = mp.size();
+    pr->lookups = mp.n_lookups();
+    pr->probes = mp.n_probes();
+    pr->grows = mp.n_grows();
+    pr->table_bytes = mp.bytes();
+    pr->load = mp.load();
+}
+
+static inline double ratio(double a, double b)
+{
+    return b ? a / b : 0;
+}
+
+/* Print the profile, and write it as JSON to json if given. */
+static void profile_report(const profile_t *pr, const char *json)
+{
+    FILE *fp = NULL;
+    int i;
+
+    if (!pr->on)
+        return;
+    error("Phase\tWall s\tCPU s\tMain s\tRecords\tRecords/s\tLoop\tRead");
+    for (i = 0; i < N_PHASES; i++) {
+        error("%s\t%.3f\t%.3f\t%.3f\t%" PRIu64 "\t%.0f\t%.0f%%\t%.0f%%", phase_names[i],
+              pr->wall[i] * 1e-9, pr->cpu[i] * 1e-9, pr->main[i] * 1e-9, pr->records[i],
+              ratio(pr->records[i], pr->wall[i] * 1e-9),
+              100 * ratio(pr->loop[i], pr->loop[i] + pr->reading[i]),
+              100 * ratio(pr->reading[i], pr->loop[i] + pr->reading[i]));
+    }
+    error("Table keys:\t%" PRIu64, pr->keys);
+    error("Table probes per lookup:\t%.3f", ratio(pr->probes, pr->lookups));
+    error("Table load factor:\t%.3f", pr->load);
+    error("Table grows:\t%" PRIu64, pr->grows);
+    error("Table bytes:\t%" PRIu64, pr->table_bytes);
+    if (pr->queue_samples) {
+        error("Input queue ready:\t%.1f of %" PRIu64, ratio(pr->queue_ready, pr->queue_samples), pr->queue_size);
+        error("Input queue in use:\t%.1f of %" PRIu64, ratio(pr->queue_busy, pr->queue_samples), pr->queue_size);
+    }
+    // counters per million records of the passes, on the main thread
+    for (i = 0; i < N_PERF && pr->perf_fd[i] < 0; i++)
+        ;
+    if (i < N_PERF) {
+        error("Per million records\tcycles\tinstructions\tLLC misses\tdTLB misses\tbranch misses\tIPC");
+        for (int k = 0; k < 2; k++) {
+            i = k ? PHASE_PASS2 : PHASE_PASS1;
+            double m = pr->records[i] / 1e6;
+            error("%s\t%.0f\t%.0f\t%.0f\t%.0f\t%.0f\t%.2f", phase_names[i],
+                  ratio(pr->perf[i][PERF_CYCLES], m), ratio(pr->perf[i][PERF_INSTRUCTIONS], m),
+                  ratio(pr->perf[i][PERF_LLC_MISSES], m), ratio(pr->perf[i][PERF_DTLB_MISSES], m),
+                  ratio(pr->perf[i][PERF_BRANCH_MISSES], m),
+                  ratio(pr->perf[i][PERF_INSTRUCTIONS], pr->perf[i][PERF_CYCLES]));
+        }
+    }
+
+    if (!json)
+        return;
+    if (!(fp = fopen(json, "w"))) {
+        error("Couldn't write the profile to \"%s\"", json);
+        return;
+    }
+    fprintf(fp, "{\n  \"phases\": [\n");
+    for (i = 0; i < N_PHASES; i++) {
+        fprintf(fp, "    {\"name\": \"%s\", \"wall_s\": %.6f, \"cpu_s\": %.6f, \"main_cpu_s\": %.6f, "
+                "\"records\": %" PRIu64 ", \"records_per_s\": %.1f, \"loop_fraction\": %.4f, "
+                "\"read_fraction\": %.4f, \"per_million_records\": {", phase_names[i],
+                pr->wall[i] * 1e-9, pr->cpu[i] * 1e-9, pr->main[i] * 1e-9, pr->records[i],
+                ratio(pr->records[i], pr->wall[i] * 1e-9),
+                ratio(pr->loop[i], pr->loop[i] + pr->reading[i]),
+                ratio(pr->reading[i], pr->loop[i] + pr->reading[i]));
+        // counters the kernel would not give are null
+        for (int j = 0; j < N_PERF; j++) {
+            if (pr->perf_fd[j] < 0 || !pr->records[i])
+                fprintf(fp, "%s\"%s\": null", j ? ", " : "", perf_names[j]);
+            else
+                fprintf(fp, "%s\"%s\": %.1f", j ? ", " : "", perf_names[j], pr->perf[i][j] / (pr->records[i] / 1e6));
+        }
+        fprintf(fp, "}}%s\n", i + 1 < N_PHASES ? "," : "");
+    }
+    fprintf(fp, "  ],\n  \"table\": {\"keys\": %" PRIu64 ", \"lookups\": %" PRIu64 ", "
+            "\"probes_per_lookup\": %.4f, \"load_factor\": %.4f, \"grows\": %" PRIu64 ", "
+            "\"bytes\": %" PRIu64 "},\n", pr->keys, pr->lookups, ratio(pr->probes, pr->lookups),
+            pr->load, pr->grows, pr->table_bytes);
+    fprintf(fp, "  \"input_queue\": {\"size\": %" PRIu64 ", \"ready\": %.2f, \"in_use\": %.2f}\n}\n",
+            pr->queue_size, ratio(pr->queue_ready, pr->queue_samples),
+            ratio(pr->queue_busy, pr->queue_samples));
+    if (fclose(fp) != 0)
+        error("Couldn't write the profile to \"%s\"", json);
+}
+
+static void dedup_stream(const char *filename, const doopa_opts_t *opts);
+
+/* Deduplicate one or more coordinate sorted, indexed bam files as if they
+   were one, merging them on the fly. */
+static void dedup_bam(char **filenames, int n_files, const doopa_opts_t *opts)
+{
+    htsThreadPool p = {NULL, 0};
+    dedup_stats_t st = {0};
+    uint64_t qualsum, id;
+    mate_cache_t mates;
+    pending_mate_t mate;
+    bam1_t *b;
+    bam_hdr_t *hdr = NULL;
+    samFile *out = NULL;
+    std::vector<input_t> inputs(n_files);
+    input_after after = { &inputs };
+    input_heap_t heap(after);
+    int64_t arena_idx;
+    arena_t arena;
+    bool use_arena = false;
+    bool grouped = false;
+    bool unsorted = false;
+    bool any_cram = false;
+    bool any_text = false;
+    const char *state = opts->from_pass1;
+    const char *save = opts->pass1_only ? opts->pass1_only : opts->checkpoint;
+    uint64_t since_checkpoint = 0;
+    profile_t prof;
+    uint64_t t0 = 0, t1 = 0, batch = 0;
+    int i, ret, done = 0;
+    htsFormat _bam;
+    hts_parse_format(&_bam, "bam");
+
+    if (n_files > MAX_INPUTS) {
+        error("at most %d inputs can be merged", MAX_INPUTS);
+        exit(1);
+    }
+
+    for (i = 0; i < n_files; i++) {
+        const char *filename = filenames[i];
+        htsFile *fp = hts_open(filename,"r");
+        struct stat sb;
+        if (!fp) {
+            if (errno == ENOEXEC) {
+                error("Couldn't understand format of \"%s\"", filename);
+                exit(1);
+            } else {
+                error("Couldn't open \"%s\"", filename);
+                exit(1);
+            }
+        }
+
+        enum htsExactFormat format = hts_get_format(fp)->format;
+        if (format != bam && format != cram && !is_sam_text(fp)) {
+            error("File \"%s\" is not a bam, cram or uncompressed sam file", filename);
+            exit(1);
+        }
+        any_cram |= format == cram;
+        any_text |= format == sam;
+        if (format == bam && stat(filename, &sb) == 0 && (uint64_t)sb.st_size > MAX_INPUT_SIZE) {
+            error("\"%s\" is larger than 1 TiB, the offsets of its reads do not fit in a read id", filename);
+            exit(1);
+        }
+
+        if ((hdr = sam_hdr_read(fp))) {
+            grouped |= header_grouped_by_name(hdr);
+            unsorted |= header_hd_has(hdr, "SO:unsorted");
+            bam_hdr_destroy(hdr);
+            hdr = NULL;
+        }
+        hts_close(fp);
+    }
+
+    if (opts->sidecar && (opts->sort || unsorted || opts->queryname || grouped || any_cram || any_text)) {
+        error("--sidecar needs coordinate sorted, indexed bam input");
+        exit(1);
+    }
+    if ((opts->pass1_only || opts->from_pass1 || opts->checkpoint) &&
+            (opts->sort || unsorted || opts->queryname || grouped || any_text)) {
+        error("saving pass 1 needs coordinate sorted, indexed bam or cram input");
+        exit(1);
+    }
+
+    if (opts->profile && (opts->n_regions || opts->regions_file || opts->n_shards || opts->sort ||
+            unsorted || opts->queryname || grouped || any_text))
+        error("--profile only times the passes over sorted, indexed input, it is left out");
+
+    if (opts->n_regions || opts->regions_file || opts->n_shards) {
+        if (opts->sort || unsorted || opts->queryname || grouped || any_cram || any_text || n_files > 1) {
+            error("--region and --shard need a single coordinate sorted, indexed bam input");
+            exit(1);
+        }
+        dedup_regions(filenames[0], opts);
+        return;
+    }
+
+    if (opts->sort || unsorted) {
+        dedup_sort(filenames, n_files, opts);
+        return;
+    }
+    if (opts->write_index) {
+        error("--write-index needs sorted output, use --sort");
+        exit(1);
+    }
+
+    if (opts->queryname || grouped) {
+        if (any_cram || any_text) {
+            error("only bam input grouped by name is supported, use --sort");
+            exit(1);
+        }
+        if (n_files > 1) {
+            error("name grouped input cannot be merged");
+            exit(1);
+        }
+        dedup_queryname(filenames[0], opts);
+        return;
+    }
+
+    // sam text has no index, sorted text is read once like a stream
+    if (any_text) {
+        if (n_files > 1) {
+            error("sam text can only be merged with other inputs with --sort");
+            exit(1);
+        }
+        dedup_stream(filenames[0], opts);
+        return;
+    }
+
+    profile_init(&prof, opts->profile);
+    mates.max = MATE_CACHE_SIZE;
+    mates.found = mates.guessed = 0;
+
+    doopa_t mp(1000000, opts->compact_keys);
+    std::vector<uint64_t> survivors;
+
+    if (threads_init(&p, opts) < 0) {
+        error("error creating thread pool");
+        goto clean;
+    }
+
+    for (i = 0; i < n_files; i++) {
+        input_t *in = &inputs[i];
+
+        in->filename = filenames[i];
+        if (input_open(in, opts, &p) < 0) {
+            error("Couldn't open \"%s\"", in->filename);
+            exit(1);
+        }
+        if ((in->idx = sam_index_load(in->fp, in->filename)) == 0) {
+            error("cannot open index of \"%s\"", in->filename);
+            exit(1);
+        }
+        if (!in->cram)
+            in->unplaced_off = unplaced_offset(in->idx);
+
+        in->hdr = input_read_header(in, opts, &p);
+        if (in->hdr == NULL) {
+            errno = 0; error("reading headers from \"%s\" failed", in->filename);
+            goto clean;
+        }
+        if (!(in->b = bam_init1())) { error("can't create record"); exit(1); }
+    }
+
+    // with a sidecar or only pass 1 no reads are written
+    if (!opts->sidecar && !opts->pass1_only && !(out = open_output(opts, &p)))
+        goto clean;
+
+    if (!(hdr = merge_headers(inputs)))
+        goto clean;
+
+    if (!opts->stats_only && out) {
+        if (sam_hdr_write(out, hdr) != 0) {
+            error("writing headers to %s failed", out_name(opts));
+            goto clean;
+        }
+    }
+
+    // records decoded for pass 1 of a cram file are incomplete
+    // ids in a saved pass 1 must be where reads are in the inputs
+    if (opts->max_memory && !opts->stats_only && !opts->sidecar && !any_cram &&
+            !opts->pass1_only && !opts->from_pass1 && !opts->checkpoint) {
+        uint64_t need = 0, n;
+        for (i = 0; i < n_files; i++) {
+            if (!(n = estimate_arena_size(inputs[i].fp, inputs[i].hdr, inputs[i].idx, inputs[i].b))) {
+                need = 0;
+                break;
+            }
+            need += n;
+        }
+        if (need && need < opts->max_memory) {
+            error("Keeping reads in memory (about %" PRIu64 " MB)", need >> 20);
+            arena.page_used = 0;
+            arena.bytes = 0;
+            arena.limit = opts->max_memory;
+            use_arena = true;
+        }
+    }
+
+    // a checkpoint left by a run that was stopped is gone on with
+    if (!state && opts->checkpoint && access(opts->checkpoint, F_OK) == 0)
+        state = opts->checkpoint;
+    if (state) {
+        if ((done = read_state(state, inputs, &mp, &mates, &st)) < 0)
+            exit(1);
+        if (opts->from_pass1 && !done) {
+            error("pass 1 in \"%s\" is not over, go on with it with --checkpoint", state);
+            exit(1);
+        }
+        error(done ? "Pass 1 is over in \"%s\"" : "Going on with pass 1 from \"%s\"", state);
+    } else {
+        error("Start deduping...");
+    }
+    pin_opened_threads(opts);
+
+    profile_phase(&prof, PHASE_PASS1);
+    batch = trace_begin();
+    for (i = 0; i < n_files; i++) {
+        input_t *in = &inputs[i];
+        in->iter = sam_itr_queryi(in->idx, HTS_IDX_START, 0, 0);
+        if (!state) {
+            // unplaced reads are all at the end, the index knows how many
+            st.total_reads += hts_idx_get_n_no_coor(in->idx);
+        } else if (in->ended) {
+            continue;
+        } else if (input_resume(in) < 0) {
+            error("going back to where \"%s\" was in \"%s\" failed", state, in->filename);
+            exit(1);
+        }
+        if ((ret = input_next_placed(in)) > 0) {
+            heap.push(i);
+        } else if (ret < 0) {
+            error("reading \"%s\" failed", in->filename);
+            exit(1);
+        } else {
+            in->ended = true;
+        }
+    }
+
+    while (!heap.empty()) {
+        if (opts->checkpoint && ++since_checkpoint == CHECKPOINT_READS) {
+            // every input not through has its next read waiting
+            if (save_state(opts->checkpoint, inputs, mp, &mates, &st, false) < 0)
+                error("Couldn't save a checkpoint to \"%s\"", opts->checkpoint);
+            since_checkpoint = 0;
+        }
+        input_t *in = &inputs[heap.top()];
+        heap.pop();
+        b = in->b;
+        id = READ_ID(in - &inputs[0], in->voffset);
+
+        st.total_reads++;
+        if (profile_sampled(&prof, prof.records[PHASE_PASS1]++))
+            t0 = now_ns();
+        if (batch && prof.records[PHASE_PASS1] % TRACE_BATCH == 0) {
+            trace_end("pass 1 reads", batch);
+            batch = trace_begin();
+        }
+        if (*opts->debugread && !strncmp((const char *)b->data, opts->debugread, 128)) {
+            error("found debugread %s", opts->debugread);
+        }
+        if (count_read(&st, b)) {
+            qualsum = get_qualsum(b, &st.total_bases, &st.bases_above_q30);
+            if (use_arena) {
+                if ((arena_idx = arena_push(&arena, b, id)) >= 0) {
+                    id = arena_idx;
+                } else {
+                    // the estimate was off, go back to reading pass 2 from disk
+                    error("Reads do not fit in memory, rereading them instead");
+                    for (doopa_t::iterator it = mp.begin(); it != mp.end(); it++) {
+                        std::get<0>(it->second) = arena_get(&arena, std::get<0>(it->second))->id;
+                    }
+                    for (std::unordered_map<uint64_t, pending_mate_t>::iterator it = mates.pending.begin();
+                            it != mates.pending.end(); it++) {
+                        it->second.id = arena_get(&arena, it->second.id)->id;
+                    }
+                    arena_destroy(&arena);
+                    use_arena = false;
+                }
+            }
+            add_sorted_read(&mp, &mates, b, id, qualsum, &st);
+        }
+
+        if (t0)
+            t1 = now_ns();
+        if ((ret = input_next_placed(in)) > 0) {
+            heap.push(in - &inputs[0]);
+        } else if (ret < 0) {
+            error("reading \"%s\" failed", in->filename);
+            exit(1);
+        } else {
+            in->ended = true;
+        }
+        if (t0) {
+            profile_sample(&prof, t0, t1, in->reader);
+            t0 = 0;
+        }
+    }
+    trace_end("pass 1 reads", batch);
+    profile_phase(&prof, PHASE_STATS);
+    while (mate_cache_pop(&mates, &mate)) {
+        add_read(&mp, mate.fallback, mate.id, mate.qualsum, &st);
+    }
+    if (save && !done && save_state(save, inputs, mp, &mates, &st, true) < 0) {
+        error("Couldn't save pass 1 to \"%s\"", save);
+        exit(1);
+    }
+    for (i = 0; i < n_files; i++) {
+        st.total_reads += inputs[i].n_unplaced;
+    }
+    print_stats(&st);
+    print_collisions(mp);
+    print_mate_stats(&mates);
+    profile_table(&prof, mp);
+    if (opts->pass1_only) {
+        error("Done");
+        goto clean;
+    }
+
+    if (!opts->stats_only || opts->sidecar) {
+        // winners are identified by where they live in the inputs
+        survivors.reserve(mp.size());
+        for (doopa_t::iterator it = mp.begin(); it != mp.end(); it++) {
+            survivors.push_back(std::get<0>(it->second));
+        }
+        mp.clear();
+        std::sort(survivors.begin(), survivors.end());
+    }
+
+    profile_phase(&prof, PHASE_PASS2);
+    if (opts->sidecar) {
+        size_t start = 0, end;
+        for (i = 0; i < n_files; i++) {
+            for (end = start; end < survivors.size() && READ_INPUT(survivors[end]) == i; end++)
+                ;
+            if (write_sidecar(&inputs[i], survivors.data() + start, end - start) < 0) {
+                error("writing \"%s.doopa\" failed", inputs[i].filename);
+                exit(1);
+            }
+            start = end;
+        }
+    } else if (!opts->stats_only) {
+        if (use_arena) {
+            if (write_arena_survivors(out, hdr, &arena, survivors) < 0) {
+                error("writing to %s failed", out_name(opts));
+                exit(1);
+            }
+            prof.records[PHASE_PASS2] = survivors.size();
+            arena_destroy(&arena);
+        } else {
+            // survivors are sorted by input first, give each input its share
+            size_t start = 0, end;
+            for (i = 0; i < n_files; i++) {
+                for (end = start; end < survivors.size() && READ_INPUT(survivors[end]) == i; end++)
+                    ;
+                inputs[i].survivors = survivors.data() + start;
+                inputs[i].n_survivors = end - start;
+                inputs[i].next = 0;
+                start = end;
+                if (inputs[i].cram && input_reopen(&inputs[i], opts, &p) < 0) {
+                    error("reopening \"%s\" failed", inputs[i].filename);
+                    exit(1);
+                }
+                if ((ret = input_next_survivor(&inputs[i])) > 0) {
+                    heap.push(i);
+                } else if (ret < 0) {
+                    error("reading \"%s\" failed", inputs[i].filename);
+                    exit(1);
+                }
+            }
+            pin_opened_threads(opts);
+            batch = trace_begin();
+            while (!heap.empty()) {
+                input_t *in = &inputs[heap.top()];
+                heap.pop();
+                if (profile_sampled(&prof, prof.records[PHASE_PASS2]++))
+                    t0 = now_ns();
+                if (batch && prof.records[PHASE_PASS2] % TRACE_BATCH == 0) {
+                    trace_end("pass 2 reads", batch);
+                    batch = trace_begin();
+                }
+                if (sam_write1(out, hdr, in->b) < 0) {
+                    error("writing to %s failed", out_name(opts));
+                    exit(1);
+                }
+                if (t0)
+                    t1 = now_ns();
+                if ((ret = input_next_survivor(in)) > 0) {
+                    heap.push(in - &inputs[0]);
+                } else if (ret < 0) {
+                    error("reading \"%s\" failed", in->filename);
+                    exit(1);
+                }
+                if (t0) {
+                    profile_sample(&prof, t0, t1, in->reader);
+                    t0 = 0;
+                }
+            }
+            trace_end("pass 2 reads", batch);
+        }
+        for (i = 0; i < n_files; i++) {
+            input_t *in = &inputs[i];
+            if ((hts_idx_get_n_no_coor(in->idx) || in->n_unplaced) &&
+                    write_unplaced(in->fp, out, hdr, in->b, in->unplaced_off) < 0) {
+                error("writing unplaced reads to %s failed", out_name(opts));
+                exit(1);
+            }
+        }
+    }
+    // the run is over, a later one must not take it for its own
+    if (opts->checkpoint && unlink(opts->checkpoint) < 0)
+        error("Couldn't remove \"%s\"", opts->checkpoint);
+    error("Done");
+
+clean:
+    profile_phase(&prof, PHASE_CLOSE);
+    for (i = 0; i < n_files; i++) {
+        input_t *in = &inputs[i];
+        reader_close(in->reader);
+        if (in->b) bam_destroy1(in->b);
+        if (in->iter) hts_itr_destroy(in->iter);
+        if (in->idx) hts_idx_destroy(in->idx);
+        if (in->hdr) bam_hdr_destroy(in->hdr);
+        if (in->fp) sam_close(in->fp);
+    }
+    bam_hdr_destroy(hdr);
+    if (out && sam_close(out) < 0) {
+        error("could not close output file");
+    }
+    if (p.pool) hts_tpool_destroy(p.pool);
+    profile_phase(&prof, N_PHASES);
+    profile_report(&prof, opts->profile_json);
+}
+
+/* State of a single pass over a coordinate sorted stream */
+typedef struct {
+    std::deque<stream_read_t> window;
+    std::vector<bam1_t *> spare;
+    groups_t *groups;
+    mate_cache_t mates;
+    std::multimap<int32_t, uint64_t> unkeyed; // start -> serial of reads waiting for a mate
+    dedup_stats_t st;
+    sam_text_t *text; // reads are light records from sam text
+    bam1_t *full;
+} stream_t;
+
+static inline stream_read_t *stream_get(stream_t *sm, uint64_t serial)
+{
+    return &sm->window[serial - sm->window.front().serial];
+}
+
+/* Put a read whose key is known into its group. */
+static void stream_add(stream_t *sm, stream_read_t *r)
+{
+    groups_t::iterator g = sm->groups->find(r->key);
+
+    r->keyed = true;
+    if (g != sm->groups->end()) {
+        sm->st.duplicate_reads++;
+        if (r->qualsum > g->second.qualsum) {
+            g->second.best = r->serial;
+            g->second.qualsum = r->qualsum;
+        }
+        g->second.pending++;
+    } else {
+        group_t grp = { r->serial, r->qualsum, 1 };
+        sm->groups->insert(std::make_pair(r->key, grp));
+    }
+}
+
+static void stream_forget_unkeyed(stream_t *sm, const stream_read_t *r)
+{
+    std::pair<std::multimap<int32_t, uint64_t>::iterator,
+              std::multimap<int32_t, uint64_t>::iterator> range = sm->unkeyed.equal_range(r->start);
+
+    for (std::multimap<int32_t, uint64_t>::iterator it = range.first; it != range.second; it++) {
+        if (it->second == r->serial) {
+            sm->unkeyed.erase(it);
+            return;
+        }
+    }
+}
+
+/* Give a read still waiting for its mate the guessed key. */
+static void stream_guess(stream_t *sm, stream_read_t *r)
+{
+    pending_mate_t mate;
+
+    if (mate_cache_take_read(&sm->mates, r->b, &mate)) {
+        r->key = mate.fallback;
+    } else {
+        make_key(&r->key, r->b);
+    }
+    stream_forget_unkeyed(sm, r);
+    stream_add(sm, r);
+}
+
+/* Write a read, parsing it in full first if it came from sam text. */
+static int stream_write(stream_t *sm, samFile *out, bam_hdr_t *hdr, bam1_t *b)
+{
+    if (!sm->text)
+        return sam_write1(out, hdr, b);
+    if (sam_text_full(b, hdr, sm->full) < 0)
+        return -1;
+    return sam_write1(out, hdr, sm->full);
+}
+
+/* Write or drop the oldest read in the window, once all its duplicates are in. */
+static int stream_emit(stream_t *sm, samFile *out, bam_hdr_t *hdr)
+{
+    stream_read_t *r = &sm->window.front();
+    std::multimap<int32_t, uint64_t>::iterator it;
+    groups_t::iterator g;
+    int ret = 0;
+
+    // reads sharing its start may share its key, they cannot wait any longer
+    if (!r->keyed)
+        stream_guess(sm, r);
+    while ((it = sm->unkeyed.find(r->start)) != sm->unkeyed.end())
+        stream_guess(sm, stream_get(sm, it->second));
+
+    g = sm->groups->find(r->key);
+    if (out && g->second.best == r->serial) {
+        ret = stream_write(sm, out, hdr, r->b);
+    }
+    if (--g->second.pending == 0) {
+        sm->groups->erase(g);
+    }
+    sm->spare.push_back(r->b);
+    sm->window.pop_front();
+    return ret;
+}
+
+/* Deduplicate a coordinate sorted bam or sam stream in a single pass, without an index.
+   A read is written once no later read can start at or before its unclipped start,
+   which is at most opts->window bases behind the current read. Reads without an
+   MC tag wait in the window for their mate for as long as they can. */
+static void dedup_stream(const char *filename, const doopa_opts_t *opts)
+{
+    htsThreadPool p = {NULL, 0};
+    stream_t sm;
+    node_pool_t pool;
+    groups_t groups((groups_t::size_type)100000, key_hash, key_equal_to, groups_t::allocator_type(&pool));
+    pending_mate_t mate;
+    stream_read_t r;
+    uint64_t serial = 0;
+    int64_t n;
+    int32_t last_tid = -1;
+    hts_pos_t last_pos = 0;
+    int ret;
+    bam1_t *b = NULL;
+    bam_hdr_t *hdr = NULL;
+    samFile *out = NULL;
+    samFile *in = NULL;
+
+    sm.st = dedup_stats_t();
+    sm.groups = &groups;
+    sm.mates.max = MATE_CACHE_SIZE;
+    sm.mates.found = sm.mates.guessed = 0;
+    sm.text = NULL;
+    sm.full = NULL;
+
+    in = sam_open(filename, "r");
+    if (!in) {
+        error("Couldn't open \"%s\"", filename);
+        exit(1);
+    }
+    if (hts_get_format(in)->format != bam && hts_get_format(in)->format != sam) {
+        error("File \"%s\" is not a bam or sam file", filename);
+        exit(1);
+    }
+    if (is_sam_text(in)) {
+        if (!(sm.text = sam_text_init(in->fp.hfile)) || !(sm.full = bam_init1())) {
+            error("can't create record");
+            exit(1);
+        }
+    }
+
+    if (threads_init(&p, opts) < 0) {
+        error("error creating thread pool");
+        goto clean;
+    }
+    hts_set_opt(in, HTS_OPT_THREAD_POOL, &p);
+
+    if (!opts->stats_only && !(out = open_output(opts, &p)))
+        goto clean;
+
+    hdr = sm.text ? sam_text_header(sm.text) : sam_hdr_read(in);
+    if (hdr == NULL) {
+        errno = 0; error("reading headers from \"%s\" failed", filename);
+        goto clean;
+    }
+    if (!header_coordinate_sorted(hdr)) {
+        error("\"%s\" does not say it is sorted by coordinate (@HD SO:coordinate), "
+              "sort it first or use --sort on a file", filename);
+        exit(1);
+    }
+
+    if (out && sam_hdr_write(out, hdr) != 0) {
+        error("writing headers to %s failed", out_name(opts));
+        goto clean;
+    }
+
+    pin_opened_threads(opts);
+    error("Start deduping...");
+
+    for (;;) {
+        if (sm.spare.empty()) {
+            if (!(b = bam_init1())) { error("can't create record"); exit(1); }
+        } else {
+            b = sm.spare.back();
+            sm.spare.pop_back();
+        }
+        ret = sm.text ? sam_text_read(sm.text, hdr, b) : sam_read1(in, hdr, b);
+        if (ret < -1) {
+            error("reading \"%s\" failed", filename);
+            exit(1);
+        }
+        if (ret < 0 || b->core.tid < 0) {
+            // end of the placed reads, everything buffered is complete
+            while (!sm.window.empty()) {
+                if (stream_emit(&sm, out, hdr) < 0) {
+                    error("writing to %s failed", out_name(opts));
+                    exit(1);
+                }
+            }
+            if (ret < 0) {
+                sm.spare.push_back(b);
+                break;
+            }
+            // no placed read may follow
+            last_tid = INT32_MAX;
+            sm.st.total_reads++;
+            if (out && stream_write(&sm, out, hdr, b) < 0) {
+                error("writing to %s failed", out_name(opts));
+                exit(1);
+            }
+            sm.spare.push_back(b);
+            if (out && out->format.format == bam && in->format.format == bam) {
+                n = copy_bam_tail(in->fp.bgzf, out->fp.bgzf);
+                if (n < 0) {
+                    error("copying unplaced reads to %s failed", out_name(opts));
+                    exit(1);
+                }
+                sm.st.total_reads += n;
+                break;
+            }
+            continue;
+        }
+
+        const bam1_core_t *c = &b->core;
+        if (c->tid < last_tid || (c->tid == last_tid && c->pos < last_pos)) {
+            error("\"%s\" is not sorted by coordinate, read %s is out of order", filename, bam_get_qname(b));
+            exit(1);
+        }
+        last_tid = c->tid;
+        last_pos = c->pos;
+        sm.st.total_reads++;
+        if (*opts->debugread && !strncmp((const char *)b->data, opts->debugread, 128)) {
+            error("found debugread %s", opts->debugread);
+        }
+        while (!sm.window.empty() && (sm.window.front().tid != c->tid ||
+                (int64_t)c->pos + 1 - sm.window.front().start > opts->window)) {
+            if (stream_emit(&sm, out, hdr) < 0) {
+                error("writing to %s failed", out_name(opts));
+                exit(1);
+            }
+        }
+        if (!count_read(&sm.st, b)) {
+            sm.spare.push_back(b);
+            continue;
+        }
+
+        r.b = b;
+        r.serial = serial++;
+        r.qualsum = get_qualsum(b, &sm.st.total_bases, &sm.st.bases_above_q30);
+        r.tid = c->tid;
+        r.start = unclipped_start(b);
+        r.keyed = false;
+
+        if (!needs_mate(b)) {
+            make_key(&r.key, b);
+        } else if (mate_cache_take(&sm.mates, b, &mate)) {
+            stream_read_t *m = stream_get(&sm, mate.id);
+            m->key.lo = mate.end;
+            m->key.hi = pack_end(b);
+            stream_forget_unkeyed(&sm, m);
+            stream_add(&sm, m);
+            r.key.lo = m->key.hi;
+            r.key.hi = mate.end;
+        } else if (mate_ahead(c)) {
+            if (mate_cache_put(&sm.mates, b, r.serial, r.qualsum, &mate)) {
+                stream_read_t *m = stream_get(&sm, mate.id);
+                m->key = mate.fallback;
+                stream_forget_unkeyed(&sm, m);
+                stream_add(&sm, m);
+            }
+            sm.unkeyed.insert(std::make_pair(r.start, r.serial));
+            sm.window.push_back(r);
+            continue;
+        } else {
+            make_key(&r.key, b);
+        }
+        sm.window.push_back(r);
+        stream_add(&sm, &sm.window.back());
+    }
+
+    print_stats(&sm.st);
+    print_mate_stats(&sm.mates);
+    error("Done");
+
+clean:
+    for (size_t i = 0; i < sm.spare.size(); i++) {
+        bam_destroy1(sm.spare[i]);
+    }
+    sam_text_destroy(sm.text);
+    if (sm.full) bam_destroy1(sm.full);
+    bam_hdr_destroy(hdr);
+    sam_close(in);
+    if (out && sam_close(out) < 0) {
+        error("could not close output file");
+    }
+    if (p.pool) hts_tpool_destroy(p.pool);
+}
+
+/* Write the survivors that overlap a region query. Only those in the
+   query's chunks are looked up in the sidecar and read. */
+static int view_region(input_t *in, const sidecar_t *sc, hts_itr_t *iter, samFile *out)
+{
+    const uint64_t *end = sc->survivors + sc->hdr->n_survivors, *lo, *hi;
+    const bam1_core_t *c = &in->b->core;
+    int ret = 0;
+
+    for (int k = 0; k < iter->n_off; k++) {
+        lo = std::lower_bound(sc->survivors, end, iter->off[k].u);
+        hi = std::lower_bound(lo, end, iter->off[k].v);
+        in->survivors = lo;
+        in->n_survivors = hi - lo;
+        in->next = 0;
+        while ((ret = input_next_survivor(in)) > 0) {
+            if (c->tid == iter->tid && c->pos < iter->end && bam_endpos(in->b) > iter->beg &&
+                    sam_write1(out, in->hdr, in->b) < 0)
+                return -1;
+        }
+        if (ret < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Write the unplaced reads of a viewed file. */
+static int view_unplaced(input_t *in, const sidecar_t *sc, samFile *out)
+{
+    const sidecar_hdr_t *h = sc->hdr;
+
+    if (!h->n_unplaced)
+        return 0;
+    if (!h->unplaced_off && h->n_survivors) {
+        // they follow the last survivor
+        in->survivors = sc->survivors + h->n_survivors - 1;
+        in->n_survivors = 1;
+        in->next = 0;
+        if (input_next_survivor(in) < 0)
+            return -1;
+    }
+    return write_unplaced(in->fp, out, in->hdr, in->b, h->unplaced_off);
+}
+
+/* doopa view: read a bam file deduplicated through its sidecar, written
+   by doopa --sidecar, either whole or the given regions. */
+static int doopa_view(int argc, char **argv)
+{
+    htsThreadPool p = {NULL, 0};
+    doopa_opts_t opts;
+    sidecar_t sc = {0};
+    input_t in;
+    samFile *out = NULL;
+    hts_itr_t *iter;
+    char outfmt[16] = "sam";
+    int c, ret = 1;
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&in, 0, sizeof(in));
+    opts.out_fmt = outfmt;
+    opts.threads = DEFAULT_THREADS;
+
+    while (1) {
+        static struct option long_options[] = {
+            {"output-fmt", required_argument, 0, 'O' },
+            {"output",    required_argument, 0, 'o' },
+            {"reference", required_argument, 0, 'T' },
+            {"threads",   required_argument, 0, '@' },
+            {0,           0,                 0,  0  }
+        };
+
+        c = getopt_long(argc, argv, "O:o:T:@:", long_options, NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 'O':
+            snprintf(outfmt, 16, "%s", optarg);
+            break;
+
+        case 'o':
+            opts.out_file = optarg;
+            break;
+
+        case 'T':
+            opts.reference = optarg;
+            break;
+
+        case '@':
+            if ((opts.threads = parse_threads(optarg)) < 1) {
+                error("--threads takes a number of threads or auto");
+                return 1;
+            }
+            break;
+
+        default:
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        error("usage: doopa view [-O FMT] [-o FILE] input.bam [region...]");
+        return 1;
+    }
+    in.filename = argv[optind++];
+
+    if (sidecar_map(&sc, in.filename) < 0)
+        return 1;
+    if (threads_init(&p, &opts) < 0) {
+        error("error creating thread pool");
+        goto clean;
+    }
+    if (!(in.fp = sam_open(in.filename, "r")) || in.fp->format.format != bam) {
+        error("Couldn't open \"%s\" as bam", in.filename);
+        goto clean;
+    }
+    hts_set_opt(in.fp, HTS_OPT_THREAD_POOL, &p);
+    if (!(in.hdr = sam_hdr_read(in.fp)) || !(in.b = bam_init1())) {
+        error("reading headers from \"%s\" failed", in.filename);
+        goto clean;
+    }
+    if (optind < argc && !(in.idx = sam_index_load(in.fp, in.filename))) {
+        error("cannot open index of \"%s\"", in.filename);
+        goto clean;
+    }
+
+    if (!(out = open_output(&opts, &p)))
+        goto clean;
+    if (sam_hdr_write(out, in.hdr) != 0) {
+        error("writing headers failed");
+        goto clean;
+    }
+
+    if (optind == argc) {
+        // the whole file
+        in.survivors = sc.survivors;
+        in.n_survivors = sc.hdr->n_survivors;
+        while ((c = input_next_survivor(&in)) > 0) {
+            if (sam_write1(out, in.hdr, in.b) < 0)
+                break;
+        }
+        if (c != 0 || view_unplaced(&in, &sc, out) < 0) {
+            error("viewing \"%s\" failed", in.filename);
+            goto clean;
+        }
+    }
+    // regions are read one after the other, as given
+    for (; optind < argc; optind++) {
+        if (!(iter = sam_itr_querys(in.idx, in.hdr, argv[optind]))) {
+            error("bad region \"%s\"", argv[optind]);
+            goto clean;
+        }
+        c = iter->tid == HTS_IDX_NOCOOR ? view_unplaced(&in, &sc, out)
+                                        : view_region(&in, &sc, iter, out);
+        hts_itr_destroy(iter);
+        if (c < 0) {
+            error("viewing \"%s\" of \"%s\" failed", argv[optind], in.filename);
+            goto clean;
+        }
+    }
+    ret = 0;
+
+clean:
+    if (out && sam_close(out) < 0) {
+        error("could not close output file");
+        ret = 1;
+    }
+    if (in.b) bam_destroy1(in.b);
+    if (in.idx) hts_idx_destroy(in.idx);
+    if (in.hdr) bam_hdr_destroy(in.hdr);
+    if (in.fp) sam_close(in.fp);
+    sidecar_unmap(&sc);
+    if (p.pool) hts_tpool_destroy(p.pool);
+    return ret;
+}
+
+/* doopa merge-state: merge the finished pass 1 states of runs over
+   different inputs, such as the first sequencing of a sample and a top-up.
+   The merged state lists the inputs of each state in turn, and is used
+   with --from-pass1 on all of them in that order. */
+static int doopa_merge_state(int argc, char **argv)
+{
+    const char *out_file = NULL, *path;
+    std::vector<state_input_t> inputs;
+    doopa_t mp(1000000);
+    mate_cache_t mates;
+    dedup_stats_t st = {0};
+    state_map_t sm;
+    const state_key_t *k;
+    size_t base;
+    int c;
+
+    mates.max = 0;
+    mates.found = mates.guessed = 0;
+
+    while ((c = getopt(argc, argv, "o:")) != -1) {
+        if (c != 'o')
+            return 1;
+        out_file = optarg;
+    }
+    if (!out_file || optind >= argc) {
+        error("usage: doopa merge-state -o OUT.state IN.state...");
+        return 1;
+    }
+
+    for (; optind < argc; optind++) {
+        path = argv[optind];
+        base = inputs.size();
+        if (state_map(&sm, path) < 0)
+            return 1;
+        if (!sm.h->done) {
+            error("pass 1 in \"%s\" is not over", path);
+            goto fail;
+        }
+        if (base + sm.h->n_inputs > MAX_INPUTS) {
+            error("at most %d inputs can be merged", MAX_INPUTS);
+            goto fail;
+        }
+        for (uint32_t i = 0; i < sm.h->n_inputs; i++) {
+            for (size_t j = 0; j < base; j++) {
+                if (!strcmp(inputs[j].name, sm.inputs[i].name) && inputs[j].size == sm.inputs[i].size) {
+                    error("\"%s\" is in more than one state", inputs[j].name);
+                    goto fail;
+                }
+            }
+            inputs.push_back(sm.inputs[i]);
+        }
+        // reads are renumbered after the inputs of the states before,
+        // equal ones go to the earlier state
+        for (uint64_t i = 0; i < sm.h->n_keys; i++) {
+            k = &sm.keys[i];
+            add_read(&mp, k->key, READ_ID(READ_INPUT(k->id) + base, READ_VOFFSET(k->id)), k->qualsum, &st);
+        }
+        state_add_stats(&sm, &st, &mates);
+        state_unmap(&sm);
+    }
+
+    if (write_state(out_file, inputs, mp, &mates, &st, true) < 0) {
+        error("Couldn't write \"%s\"", out_file);
+        return 1;
+    }
+    for (size_t i = 0; i < inputs.size(); i++) {
+        error("Input %zu:\t%s", i + 1, inputs[i].name);
+    }
+    error("Duplicate reads:\t%" PRIu64, st.duplicate_reads);
+    return 0;
+
+fail:
+    state_unmap(&sm);
+    return 1;
+}
+
+/* The empty block that ends every bgzf file. */
+static const uint8_t bgzf_eof[28] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+    0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+/* Copy len bytes of in from off to out. */
+static int copy_bytes(FILE *in, uint64_t off, uint64_t len, FILE *out)
+{
+    static char buf[1 << 20];
+    size_t n;
+
+    if (fseeko(in, off, SEEK_SET) < 0)
+        return -1;
+    while (len) {
+        n = std::min(len, (uint64_t)sizeof(buf));
+        if (fread(buf, 1, n, in) != n || fwrite(buf, 1, n, out) != n)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/* doopa merge: put the outputs of --shard back together, in shard order.
+   Their compressed blocks are copied as they are, only the first header
+   is kept, and the metrics of the shards are added up. */
+static int doopa_merge(int argc, char **argv)
+{
+    const char *out_file = NULL;
+    dedup_stats_t st = {0};
+    mate_cache_t mates;
+    uint64_t records_start, header_len = 0;
+    uint8_t tail[sizeof(bgzf_eof)];
+    std::string header;
+    struct stat sb;
+    FILE *in = NULL, *out;
+    int c;
+
+    mates.found = mates.guessed = 0;
+
+    while ((c = getopt(argc, argv, "o:")) != -1) {
+        if (c != 'o')
+            return 1;
+        out_file = optarg;
+    }
+    if (!out_file || optind >= argc) {
+        error("usage: doopa merge -o OUT.bam SHARD.bam...");
+        return 1;
+    }
+    if (!(out = fopen(out_file, "wb"))) {
+        error("Couldn't open \"%s\"", out_file);
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        const char *filename = argv[i];
+        records_start = 0;
+        errno = 0;
+        if (read_metrics(filename, &st, &mates, &records_start) < 0 || !records_start) {
+            error("Couldn't read the metrics of \"%s\", is it a shard?", filename);
+            goto fail;
+        }
+        if (!(in = fopen(filename, "rb")) || fstat(fileno(in), &sb) < 0 ||
+                (uint64_t)sb.st_size < records_start + sizeof(tail)) {
+            error("Couldn't open \"%s\"", filename);
+            goto fail;
+        }
+        if (fseeko(in, sb.st_size - sizeof(tail), SEEK_SET) < 0 ||
+                fread(tail, 1, sizeof(tail), in) != sizeof(tail) || memcmp(tail, bgzf_eof, sizeof(tail))) {
+            errno = 0; error("\"%s\" is not a whole bgzf file", filename);
+            goto fail;
+        }
+
+        // all shards must have been written with the same header
+        std::string h(records_start, '\0');
+        if (fseeko(in, 0, SEEK_SET) < 0 || fread(&h[0], 1, records_start, in) != records_start) {
+            error("reading \"%s\" failed", filename);
+            goto fail;
+        }
+        if (i == optind) {
+            header = h;
+            header_len = records_start;
+        } else if (h != header) {
+            errno = 0; error("\"%s\" has a different header than \"%s\"", filename, argv[optind]);
+            goto fail;
+        }
+
+        if (copy_bytes(in, i == optind ? 0 : records_start,
+                       sb.st_size - sizeof(tail) - (i == optind ? 0 : records_start), out) < 0) {
+            error("copying \"%s\" failed", filename);
+            goto fail;
+        }
+        fclose(in);
+        in = NULL;
+    }
+    if (fwrite(bgzf_eof, 1, sizeof(bgzf_eof), out) != sizeof(bgzf_eof) || fclose(out) != 0) {
+        error("writing \"%s\" failed", out_file);
+        return 1;
+    }
+    if (write_metrics(out_file, &st, &mates, header_len) < 0) {
+        error("writing \"%s.metrics\" failed", out_file);
+        return 1;
+    }
+    print_stats(&st);
+    print_mate_stats(&mates);
+    return 0;
+
+fail:
+    if (in) fclose(in);
+    fclose(out);
+    unlink(out_file);
+    return 1;
+}
+
+/* Inputs that can only be read once are deduplicated as a stream. */
+static bool is_stream(const char *filename)
+{
+    struct stat sb;
+
+    if (!strcmp(filename, "-"))
+        return true;
+    return stat(filename, &sb) == 0 && (S_ISFIFO(sb.st_mode) || S_ISCHR(sb.st_mode));
+}
+
+// Long options without a short one
+#define OPT_WRITE_INDEX 256
+#define OPT_MMAP 257
+#define OPT_PREFETCH 258
+#define OPT_SIDECAR 259
+#define OPT_PASS1_ONLY 260
+#define OPT_FROM_PASS1 261
+#define OPT_CHECKPOINT 262
+#define OPT_REGION 263
+#define OPT_REGIONS_FILE 264
+#define OPT_SHARD 265
+#define OPT_NUMA 266
+#define OPT_COMPACT_KEYS 267
+#define OPT_PROFILE 268
+#define OPT_TRACE 269
+
+int main(int argc, char **argv)
+{
+    int c;
+    doopa_opts_t opts;
+    char debugread[128] = {0};
+    char outfmt[16] = "sam";
+
+    opts.stats_only = false;
+    opts.debugread = debugread;
+    opts.out_fmt = outfmt;
+    opts.max_memory = 0;
+    opts.window = STREAM_WINDOW;
+    opts.queryname = false;
+    opts.out_file = NULL;
+    opts.sort = false;
+    opts.write_index = false;
+    opts.reference = NULL;
+    opts.mmap = false;
+    opts.prefetch = 0;
+    opts.sidecar = false;
+    opts.pass1_only = NULL;
+    opts.from_pass1 = NULL;
+    opts.checkpoint = NULL;
+    opts.regions = NULL;
+    opts.n_regions = 0;
+    opts.regions_file = NULL;
+    opts.shard = 0;
+    opts.n_shards = 0;
+    opts.threads = DEFAULT_THREADS;
+    opts.numa = false;
+    opts.compact_keys = false;
+    opts.profile = false;
+    opts.profile_json = NULL;
+    opts.trace = NULL;
+
+    if (argc < 2) {
+        error("needs indexed bam file as input");
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "view"))
+        return doopa_view(argc - 1, argv + 1);
+    if (!strcmp(argv[1], "merge-state"))
+        return doopa_merge_state(argc - 1, argv + 1);
+    if (!strcmp(argv[1], "merge"))
+        return doopa_merge(argc - 1, argv + 1);
+
+    while (1) {
+        int option_index = 0;
+        static struct option long_options[] = {
+            {"statsonly", no_argument,       0, 's' },
+            {"debugread", required_argument, 0, 'd' },
+            {"output-fmt", required_argument, 0, 'O' },
+            {"max-memory", required_argument, 0, 'm' },
+            {"window",    required_argument, 0, 'w' },
+            {"queryname", no_argument,       0, 'n' },
+            {"output",    required_argument, 0, 'o' },
+            {"sort",      no_argument,       0, 'S' },
+            {"write-index", no_argument,     0, OPT_WRITE_INDEX },
+            {"reference", required_argument, 0, 'T' },
+            {"mmap",      no_argument,       0, OPT_MMAP },
+            {"prefetch",  required_argument, 0, OPT_PREFETCH },
+            {"sidecar",   no_argument,       0, OPT_SIDECAR },
+            {"pass1-only", required_argument, 0, OPT_PASS1_ONLY },
+            {"from-pass1", required_argument, 0, OPT_FROM_PASS1 },
+            {"checkpoint", required_argument, 0, OPT_CHECKPOINT },
+            {"region",    required_argument, 0, OPT_REGION },
+            {"regions-file", required_argument, 0, OPT_REGIONS_FILE },
+            {"shard",     required_argument, 0, OPT_SHARD },
+            {"threads",   required_argument, 0, '@' },
+            {"numa",      no_argument,       0, OPT_NUMA },
+            {"compact-keys", no_argument,    0, OPT_COMPACT_KEYS },
+            {"profile",   optional_argument, 0, OPT_PROFILE },
+            {"trace",     required_argument, 0, OPT_TRACE },
+            {0,           0,                 0,  0  }
+        };
+
+        c = getopt_long(argc, argv, "sd:O:m:w:no:ST:@:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+        case 's':
+            opts.stats_only = true;
+            break;
+
+        case 'd':
+            snprintf(debugread, 128, optarg);
+            break;
+
+        case 'O':
+            snprintf(outfmt, 16, "%s", optarg);
+            break;
+
+        case 'm':
+            opts.max_memory = parse_size(optarg);
+            break;
+
+        case 'w':
+            opts.window = atoi(optarg);
+            break;
+
+        case 'n':
+            opts.queryname = true;
+            break;
+
+        case 'o':
+            opts.out_file = optarg;
+            break;
+
+        case 'S':
+            opts.sort = true;
+            break;
+
+        case OPT_WRITE_INDEX:
+            opts.write_index = true;
+            break;
+
+        case 'T':
+            opts.reference = optarg;
+            break;
+
+        case OPT_MMAP:
+            opts.mmap = true;
+            break;
+
+        case OPT_PREFETCH:
+            opts.prefetch = atoi(optarg);
+            break;
+
+        case OPT_SIDECAR:
+            opts.sidecar = true;
+            break;
+
+        case OPT_PASS1_ONLY:
+            opts.pass1_only = optarg;
+            break;
+
+        case OPT_FROM_PASS1:
+            opts.from_pass1 = optarg;
+            break;
+
+        case OPT_CHECKPOINT:
+            opts.checkpoint = optarg;
+            break;
+
+        case OPT_REGION:
+            opts.regions = (char **)realloc(opts.regions, (opts.n_regions + 1) * sizeof(char *));
+            opts.regions[opts.n_regions++] = optarg;
+            break;
+
+        case OPT_REGIONS_FILE:
+            opts.regions_file = optarg;
+            break;
+
+        case '@':
+            if ((opts.threads = parse_threads(optarg)) < 1) {
+                error("--threads takes a number of threads or auto");
+                return 1;
+            }
+            break;
+
+        case OPT_SHARD:
+            if (sscanf(optarg, "%d/%d", &opts.shard, &opts.n_shards) != 2 ||
+                    opts.shard < 1 || opts.shard > opts.n_shards) {
+                error("--shard takes i/N, with i from 1 to N");
+                return 1;
+            }
+            break;
+
+        case OPT_NUMA:
+            opts.numa = true;
+            break;
+
+        case OPT_COMPACT_KEYS:
+            opts.compact_keys = true;
+            break;
+
+        case OPT_PROFILE:
+            opts.profile = true;
+            opts.profile_json = optarg;
+            break;
+
+        case OPT_TRACE:
+            opts.trace = optarg;
+            break;
+
+        default:
+            printf("Invalid option code 0%o\n", c);
+        }
+    }
+
+    if (optind >= argc) {
+        error("needs indexed bam file as input");
+        return 1;
+    }
+
+    if (opts.trace)
+        trace_open(opts.trace);
+
+    if (opts.numa && numa_init() < 2) {
+        error("only one NUMA node, --numa has nothing to spread");
+        opts.numa = false;
+    }
+
+    if (opts.mmap && opts.prefetch) {
+        error("--mmap and --prefetch are two ways of reading the input, use one");
+        return 1;
+    }
+
+    if (opts.prefetch < 0 || opts.prefetch > 64) {
+        error("--prefetch takes up to 64 reads in flight");
+        return 1;
+    }
+
+    if (opts.sidecar && (opts.out_file || opts.write_index)) {
+        error("--sidecar writes no reads, it cannot be used with -o or --write-index");
+        return 1;
+    }
+
+    if (opts.pass1_only && (opts.from_pass1 || opts.sidecar || opts.out_file)) {
+        error("--pass1-only writes no reads, it cannot be used with --from-pass1, --sidecar or -o");
+        return 1;
+    }
+
+    if (opts.compact_keys && (opts.pass1_only || opts.checkpoint)) {
+        error("--compact-keys drops the keys a saved pass 1 needs, it cannot be used with --pass1-only or --checkpoint");
+        return 1;
+    }
+
+    if ((opts.n_regions || opts.regions_file || opts.n_shards) &&
+            (opts.sidecar || opts.pass1_only || opts.from_pass1 || opts.checkpoint || opts.sort)) {
+        error("--region and --shard cannot be used with --sidecar, --sort or saving pass 1");
+        return 1;
+    }
+
+    // each group of regions reads its chunks through a BGZF of its own
+    if ((opts.n_regions || opts.regions_file || opts.n_shards) && (opts.mmap || opts.prefetch)) {
+        error("--region and --shard read the input through htslib, they cannot be used with --mmap or --prefetch");
+        return 1;
+    }
+
+    if (opts.n_shards && (opts.n_regions || opts.regions_file)) {
+        error("--shard splits the whole input, it cannot be used with --region");
+        return 1;
+    }
+
+    if (opts.n_shards && (!opts.out_file || strcmp(opts.out_fmt, "bam") || opts.stats_only)) {
+        error("--shard needs bam output to a file, use -O bam -o FILE");
+        return 1;
+    }
+
+    if (opts.write_index && (!opts.out_file || (strcmp(opts.out_fmt, "bam") && strcmp(opts.out_fmt, "cram")))) {
+        error("--write-index needs bam or cram output to a file, use -O bam -o FILE");
+        return 1;
+    }
+
+    if (is_stream(argv[optind])) {
+        if (opts.sidecar) {
+            error("--sidecar needs the input in a file, it is written next to it");
+            return 1;
+        }
+        if (opts.pass1_only || opts.from_pass1 || opts.checkpoint) {
+            error("saving pass 1 needs the input in a file, it is read again");
+            return 1;
+        }
+        if (opts.n_regions || opts.regions_file || opts.n_shards) {
+            error("--region and --shard need an indexed file");
+            return 1;
+        }
+        if (opts.sort || opts.write_index) {
+            error("sorting needs the input in a file, it is read twice");
+            return 1;
+        }
+        if (opts.queryname) {
+            error("name grouped input must be a file, it is read twice");
+            return 1;
+        }
+        if (argc - optind > 1) {
+            error("a stream cannot be merged with other inputs");
+            return 1;
+        }
+        if (opts.profile)
+            error("--profile only times the passes over sorted, indexed input, it is left out");
+        dedup_stream(argv[optind], &opts);
+    } else {
+        dedup_bam(argv + optind, argc - optind, &opts);
+    }
+    free(opts.regions);
 
     return 0;
 }